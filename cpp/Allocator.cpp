@@ -0,0 +1,112 @@
+#include "Allocator.h"
+#include "Debug.h"
+
+#include <chrono>
+
+#if DEBUG_ALLOCATION_STATS
+    static unsigned long s_allocations = 0;
+    static unsigned long s_pooled = 0;
+
+    static const std::chrono::steady_clock::time_point s_start =
+        std::chrono::steady_clock::now();
+
+    static void reportAllocations()
+    {
+        using namespace std::chrono;
+        double secs = duration_cast<duration<double>>(
+            steady_clock::now() - s_start).count();
+        TRACE("allocations: %lu (%lu pooled) in %.2fs, %.0f/sec\n",
+              s_allocations, s_pooled, secs, s_allocations / secs);
+    }
+
+    static const int s_reportAtExit = atexit(reportAllocations);
+
+    #define COUNT_ALLOCATION(isPooled) \
+        do { s_allocations++; s_pooled += (isPooled); } while (false)
+#else
+    #define COUNT_ALLOCATION(isPooled)  NOOP
+#endif
+
+#if USE_POOL_ALLOCATOR
+
+namespace {
+    const size_t Granularity = 16;
+    const size_t MaxPooledSize = 256;
+    const size_t SizeClassCount = MaxPooledSize / Granularity;
+    const size_t ChunkSize = 64 * 1024;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    // Plain pointers, so that the thread-locals need no initialisation
+    // guard on each access.
+    thread_local FreeBlock* s_freeLists[SizeClassCount];
+
+    size_t sizeClass(size_t size) {
+        return (size == 0) ? 0 : (size - 1) / Granularity;
+    }
+
+    FreeBlock* refill(size_t index) {
+        size_t blockSize = (index + 1) * Granularity;
+        size_t count = ChunkSize / blockSize;
+        char* chunk = static_cast<char*>(::operator new(count * blockSize));
+
+        // Thread the new blocks together, in address order.
+        for (size_t i = 0; i < count - 1; i++) {
+            reinterpret_cast<FreeBlock*>(chunk + i * blockSize)->next =
+                reinterpret_cast<FreeBlock*>(chunk + (i + 1) * blockSize);
+        }
+        reinterpret_cast<FreeBlock*>(chunk + (count - 1) * blockSize)->next =
+            NULL;
+        return reinterpret_cast<FreeBlock*>(chunk);
+    }
+}
+
+void* Pool::allocate(size_t size)
+{
+    if (size > MaxPooledSize) {
+        COUNT_ALLOCATION(false);
+        return ::operator new(size);
+    }
+    COUNT_ALLOCATION(true);
+
+    size_t index = sizeClass(size);
+    FreeBlock* block = s_freeLists[index];
+    if (block == NULL) {
+        block = refill(index);
+    }
+    s_freeLists[index] = block->next;
+    return block;
+}
+
+void Pool::deallocate(void* p, size_t size)
+{
+    if (p == NULL) {
+        return;
+    }
+    if (size > MaxPooledSize) {
+        ::operator delete(p);
+        return;
+    }
+
+    FreeBlock* block = static_cast<FreeBlock*>(p);
+    size_t index = sizeClass(size);
+    block->next = s_freeLists[index];
+    s_freeLists[index] = block;
+}
+
+#else // !USE_POOL_ALLOCATOR
+
+void* Pool::allocate(size_t size)
+{
+    COUNT_ALLOCATION(false);
+    return ::operator new(size);
+}
+
+void Pool::deallocate(void* p, size_t size)
+{
+    ::operator delete(p);
+}
+
+#endif // USE_POOL_ALLOCATOR
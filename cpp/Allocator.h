@@ -0,0 +1,63 @@
+#ifndef INCLUDE_ALLOCATOR_H
+#define INCLUDE_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+
+// Set to 0 to send everything straight to the global operator new, for
+// comparison, e.g. make DEFINES=-DUSE_POOL_ALLOCATOR=0
+#ifndef USE_POOL_ALLOCATOR
+    #define USE_POOL_ALLOCATOR 1
+#endif
+
+// Small objects are carved out of 64KB chunks and recycled through a
+// per-thread free list for each 16-byte size class. Anything over 256 bytes
+// goes to the global operator new. Freed memory is never returned to the
+// system, only to the free list of the thread which freed it.
+namespace Pool {
+    void* allocate(size_t size);
+    void deallocate(void* p, size_t size);
+};
+
+// Routes class-specific new and delete through the pool. With a virtual
+// destructor, delete is passed the size of the most-derived class.
+#define POOL_ALLOCATED \
+    static void* operator new(size_t size) { \
+        return Pool::allocate(size); \
+    } \
+    static void operator delete(void* p, size_t size) { \
+        Pool::deallocate(p, size); \
+    } \
+
+// A standard allocator over the pool, for the containers inside values and
+// environments.
+template<class T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator() { }
+    template<class U> PoolAllocator(const PoolAllocator<U>&) { }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(Pool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        Pool::deallocate(p, n * sizeof(T));
+    }
+
+    template<class U> struct rebind { typedef PoolAllocator<U> other; };
+};
+
+template<class T, class U>
+bool operator == (const PoolAllocator<T>&, const PoolAllocator<U>&) {
+    return true;
+}
+
+template<class T, class U>
+bool operator != (const PoolAllocator<T>&, const PoolAllocator<U>&) {
+    return false;
+}
+
+#endif // INCLUDE_ALLOCATOR_H
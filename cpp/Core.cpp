@@ -1,10 +1,10 @@
 #include "MAL.h"
 #include "Environment.h"
+#include "MappedFile.h"
 #include "StaticList.h"
 #include "Types.h"
 
 #include <chrono>
-#include <fstream>
 #include <iostream>
 
 #define CHECK_ARGS_IS(expected) \
@@ -19,12 +19,14 @@
     checkArgsAtLeast(name.c_str(), expected, \
                         std::distance(argsBegin, argsEnd))
 
-static String printValues(malValueIter begin, malValueIter end,
-                           const String& sep, bool readably);
+static malValuePtr asList(const malSequence* seq);
+static void printValues(malPrinter& out, malValueIter begin, malValueIter end,
+                        const char* sep);
 
 static StaticList<malBuiltIn*> handlers;
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define INT_ARG(name) int64_t name = INTEGER_CAST(*argsBegin++)
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
@@ -52,19 +54,18 @@ static StaticList<malBuiltIn*> handlers;
 #define BUILTIN_INTOP(op, checkDivByZero) \
     BUILTIN(#op) { \
         CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
+        INT_ARG(lhs); \
+        INT_ARG(rhs); \
         if (checkDivByZero) { \
-            MAL_CHECK(rhs->value() != 0, "Division by zero"); \
+            MAL_CHECK(rhs != 0, "Division by zero"); \
         } \
-        return mal::integer(lhs->value() op rhs->value()); \
+        return mal::integer(lhs op rhs); \
     }
 
 BUILTIN_ISA("atom?",        malAtom);
 BUILTIN_ISA("keyword?",     malKeyword);
 BUILTIN_ISA("list?",        malList);
 BUILTIN_ISA("map?",         malHash);
-BUILTIN_ISA("number?",      malInteger);
 BUILTIN_ISA("sequential?",  malSequence);
 BUILTIN_ISA("string?",      malString);
 BUILTIN_ISA("symbol?",      malSymbol);
@@ -82,45 +83,48 @@ BUILTIN_IS("nil?",          nilValue);
 BUILTIN("-")
 {
     int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(malInteger, lhs);
+    INT_ARG(lhs);
     if (argCount == 1) {
-        return mal::integer(- lhs->value());
+        return mal::integer(- lhs);
     }
 
-    ARG(malInteger, rhs);
-    return mal::integer(lhs->value() - rhs->value());
+    INT_ARG(rhs);
+    return mal::integer(lhs - rhs);
 }
 
 BUILTIN("<=")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    INT_ARG(lhs);
+    INT_ARG(rhs);
 
-    return mal::boolean(lhs->value() <= rhs->value());
+    return mal::boolean(lhs <= rhs);
 }
 
 BUILTIN("=")
 {
     CHECK_ARGS_IS(2);
-    const malValue* lhs = (*argsBegin++).ptr();
-    const malValue* rhs = (*argsBegin++).ptr();
+    const malValuePtr& lhs = *argsBegin++;
+    const malValuePtr& rhs = *argsBegin++;
 
-    return mal::boolean(lhs->isEqualTo(rhs));
+    return mal::boolean(mal::equal(lhs, rhs));
 }
 
 BUILTIN("apply")
 {
     CHECK_ARGS_AT_LEAST(2);
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    const malValuePtr& op = *argsBegin++; // this gets checked in APPLY
 
-    // Copy the first N-1 arguments in.
-    malValueVec args(argsBegin, argsEnd-1);
+    // Push the first N-1 arguments.
+    malArgs args;
+    for (auto it = argsBegin; it != argsEnd-1; ++it) {
+        args.push(*it);
+    }
 
-    // Then append the argument as a list.
+    // Then the items of the last one.
     const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
     for (int i = 0; i < lastArg->count(); i++) {
-        args.push_back(lastArg->item(i));
+        args.push(lastArg->item(i));
     }
 
     return APPLY(op, args.begin(), args.end());
@@ -129,6 +133,9 @@ BUILTIN("apply")
 BUILTIN("assoc")
 {
     CHECK_ARGS_AT_LEAST(1);
+    if (const malVector* vector = DYNAMIC_CAST(malVector, *argsBegin)) {
+        return vector->assoc(argsBegin + 1, argsEnd);
+    }
     ARG(malHash, hash);
 
     return hash->assoc(argsBegin, argsEnd);
@@ -143,21 +150,23 @@ BUILTIN("atom")
 
 BUILTIN("concat")
 {
-    int count = 0;
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        const malSequence* seq = VALUE_CAST(malSequence, *it);
-        count += seq->count();
+    if (argsBegin == argsEnd) {
+        return mal::list(new malValueVec(0));
     }
-
-    malValueVec* items = new malValueVec(count);
-    int offset = 0;
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        const malSequence* seq = STATIC_CAST(malSequence, *it);
-        std::copy(seq->begin(), seq->end(), items->begin() + offset);
-        offset += seq->count();
+        VALUE_CAST(malSequence, *it);
     }
 
-    return mal::list(items);
+    // Cons everything else onto the last sequence, from the end, so that
+    // the result shares its items.
+    malValuePtr list = asList(STATIC_CAST(malSequence, *(argsEnd - 1)));
+    for (auto it = argsEnd - 1; it != argsBegin; ) {
+        const malSequence* seq = STATIC_CAST(malSequence, *--it);
+        for (int i = seq->count() - 1; i >= 0; i--) {
+            list = STATIC_CAST(malList, list)->cons(seq->item(i));
+        }
+    }
+    return list;
 }
 
 BUILTIN("conj")
@@ -171,14 +180,11 @@ BUILTIN("conj")
 BUILTIN("cons")
 {
     CHECK_ARGS_IS(2);
-    malValuePtr first = *argsBegin++;
+    const malValuePtr& first = *argsBegin++;
     ARG(malSequence, rest);
 
-    malValueVec* items = new malValueVec(1 + rest->count());
-    items->at(0) = first;
-    std::copy(rest->begin(), rest->end(), items->begin() + 1);
-
-    return mal::list(items);
+    malValuePtr list = asList(rest);
+    return STATIC_CAST(malList, list)->cons(first);
 }
 
 BUILTIN("contains?")
@@ -245,7 +251,7 @@ BUILTIN("first")
 BUILTIN("fn?")
 {
     CHECK_ARGS_IS(1);
-    malValuePtr arg = *argsBegin++;
+    const malValuePtr& arg = *argsBegin++;
 
     // Lambdas are functions, unless they're macros.
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, arg)) {
@@ -281,7 +287,28 @@ BUILTIN("keyword")
 {
     CHECK_ARGS_IS(1);
     ARG(malString, token);
-    return mal::keyword(":" + token->value());
+    StringView text = token->view();
+    String keyword(1, ':');
+    keyword.append(text.data(), text.size());
+    return mal::keyword(keyword);
+}
+
+BUILTIN("load-file")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malString, filename);
+
+    // Read and evaluate one top-level form at a time, so only the form
+    // currently being evaluated is held in memory as an AST. The file
+    // itself is mapped rather than read onto the heap.
+    MappedFilePtr file(new MappedFile(filename->view().str()));
+    StringView data = file->contents();
+    malValuePtr result = mal::nilValue();
+    malValuePtr form;
+    for (size_t offset = 0; readStr(data, offset, form); ) {
+        result = EVAL(form, NULL);
+    }
+    return result;
 }
 
 BUILTIN("macro?")
@@ -296,18 +323,24 @@ BUILTIN("macro?")
 BUILTIN("meta")
 {
     CHECK_ARGS_IS(1);
-    malValuePtr obj = *argsBegin++;
+    const malValuePtr& obj = *argsBegin++;
 
     return obj->meta();
 }
 
+BUILTIN("number?")
+{
+    CHECK_ARGS_IS(1);
+    return mal::boolean(isInteger(*argsBegin));
+}
+
 BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
     ARG(malSequence, seq);
-    ARG(malInteger,  index);
+    INT_ARG(index);
 
-    int i = index->value();
+    int i = index;
     MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
 
     return seq->item(i);
@@ -315,18 +348,24 @@ BUILTIN("nth")
 
 BUILTIN("pr-str")
 {
-    return mal::string(printValues(argsBegin, argsEnd, " ", true));
+    malPrinter out(true);
+    printValues(out, argsBegin, argsEnd, " ");
+    return mal::string(std::move(out.str()));
 }
 
 BUILTIN("println")
 {
-    std::cout << printValues(argsBegin, argsEnd, " ", false) << "\n";
+    malPrinter out(std::cout, false);
+    printValues(out, argsBegin, argsEnd, " ");
+    out.write('\n');
     return mal::nilValue();
 }
 
 BUILTIN("prn")
 {
-    std::cout << printValues(argsBegin, argsEnd, " ", true) << "\n";
+    malPrinter out(std::cout, true);
+    printValues(out, argsBegin, argsEnd, " ");
+    out.write('\n');
     return mal::nilValue();
 }
 
@@ -335,7 +374,7 @@ BUILTIN("read-string")
     CHECK_ARGS_IS(1);
     ARG(malString, str);
 
-    return readStr(str->value());
+    return readStr(str->view());
 }
 
 BUILTIN("readline")
@@ -343,7 +382,7 @@ BUILTIN("readline")
     CHECK_ARGS_IS(1);
     ARG(malString, str);
 
-    return readline(str->value());
+    return readline(str->view().str());
 }
 
 BUILTIN("reset!")
@@ -366,23 +405,22 @@ BUILTIN("rest")
 BUILTIN("seq")
 {
     CHECK_ARGS_IS(1);
-    malValuePtr arg = *argsBegin++;
+    const malValuePtr& arg = *argsBegin++;
     if (arg == mal::nilValue()) {
         return mal::nilValue();
     }
     if (const malSequence* seq = DYNAMIC_CAST(malSequence, arg)) {
-        return seq->isEmpty() ? mal::nilValue()
-                              : mal::list(seq->begin(), seq->end());
+        return seq->isEmpty() ? mal::nilValue() : asList(seq);
     }
     if (const malString* strVal = DYNAMIC_CAST(malString, arg)) {
-        const String str = strVal->value();
-        int length = str.length();
+        StringView str = strVal->view();
+        int length = str.size();
         if (length == 0)
             return mal::nilValue();
 
         malValueVec* items = new malValueVec(length);
         for (int i = 0; i < length; i++) {
-            (*items)[i] = mal::string(str.substr(i, 1));
+            (*items)[i] = mal::string(str.substr(i, 1).str());
         }
         return mal::list(items);
     }
@@ -395,23 +433,27 @@ BUILTIN("slurp")
     CHECK_ARGS_IS(1);
     ARG(malString, filename);
 
-    std::ios_base::openmode openmode =
-        std::ios::ate | std::ios::in | std::ios::binary;
-    std::ifstream file(filename->value().c_str(), openmode);
-    MAL_CHECK(!file.fail(), "Cannot open %s", filename->value().c_str());
-
-    String data;
-    data.reserve(file.tellg());
-    file.seekg(0, std::ios::beg);
-    data.append(std::istreambuf_iterator<char>(file.rdbuf()),
-                std::istreambuf_iterator<char>());
-
-    return mal::string(data);
+    // Copied, since the string outlives the mapping, which would change
+    // under it if the file did.
+    MappedFile file(filename->view().str());
+    return mal::string(file.contents().str());
 }
 
 BUILTIN("str")
 {
-    return mal::string(printValues(argsBegin, argsEnd, "", false));
+    malPrinter out(false);
+
+    // Appending to a string can often extend it in place, which makes
+    // building up a string a piece at a time linear.
+    if (argsBegin != argsEnd) {
+        if (const malString* head = DYNAMIC_CAST(malString, *argsBegin)) {
+            printValues(out, argsBegin + 1, argsEnd, "");
+            return head->append(out.str());
+        }
+    }
+
+    printValues(out, argsBegin, argsEnd, "");
+    return mal::string(std::move(out.str()));
 }
 
 BUILTIN("swap!")
@@ -419,11 +461,13 @@ BUILTIN("swap!")
     CHECK_ARGS_AT_LEAST(2);
     ARG(malAtom, atom);
 
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    const malValuePtr& op = *argsBegin++; // this gets checked in APPLY
 
-    malValueVec args(1 + argsEnd - argsBegin);
-    args[0] = atom->deref();
-    std::copy(argsBegin, argsEnd, args.begin() + 1);
+    malArgs args;
+    args.push(atom->deref());
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        args.push(*it);
+    }
 
     malValuePtr value = APPLY(op, args.begin(), args.end());
     return atom->reset(value);
@@ -433,7 +477,7 @@ BUILTIN("symbol")
 {
     CHECK_ARGS_IS(1);
     ARG(malString, token);
-    return mal::symbol(token->value());
+    return mal::symbol(token->view());
 }
 
 BUILTIN("throw")
@@ -469,32 +513,54 @@ BUILTIN("vector")
 BUILTIN("with-meta")
 {
     CHECK_ARGS_IS(2);
-    malValuePtr obj  = *argsBegin++;
-    malValuePtr meta = *argsBegin++;
+    const malValuePtr& obj  = *argsBegin++;
+    const malValuePtr& meta = *argsBegin++;
     return obj->withMeta(meta);
 }
 
-void installCore(malEnvPtr env) {
+void installCore(const malEnvPtr& env) {
     for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
         malBuiltIn* handler = *it;
         env->set(handler->name(), handler);
     }
+
+    // Limits on how much of a collection is printed, off while they're nil.
+    const malSymbol* maxLength = STATIC_CAST(malSymbol,
+                                             mal::symbol("*print-length*"));
+    const malSymbol* maxLevel = STATIC_CAST(malSymbol,
+                                            mal::symbol("*print-level*"));
+    env->set(maxLength, mal::nilValue());
+    env->set(maxLevel, mal::nilValue());
+    malPrinter::setLimits(env->cell(maxLength), env->cell(maxLevel));
 }
 
-static String printValues(malValueIter begin, malValueIter end,
-                          const String& sep, bool readably)
+// Lists are returned as they are, to share their items.
+static malValuePtr asList(const malSequence* seq)
 {
-    String out;
+    if (isa<malList>(seq)) {
+        // The same items, but not the metadata.
+        if (seq->meta() == mal::nilValue()) {
+            return malValuePtr(const_cast<malSequence*>(seq));
+        }
+        return seq->withMeta(malValuePtr());
+    }
+    malValueVec* items = new malValueVec(seq->count());
+    for (int i = 0, n = seq->count(); i < n; i++) {
+        (*items)[i] = seq->item(i);
+    }
+    return mal::list(items);
+}
 
+static void printValues(malPrinter& out, malValueIter begin, malValueIter end,
+                        const char* sep)
+{
     if (begin != end) {
-        out += (*begin)->print(readably);
+        out.print(*begin);
         ++begin;
     }
 
     for ( ; begin != end; ++begin) {
-        out += sep;
-        out += (*begin)->print(readably);
+        out.write(sep);
+        out.print(*begin);
     }
-
-    return out;
 }
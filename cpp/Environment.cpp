@@ -4,14 +4,14 @@
 #include <algorithm>
 
 malEnv::malEnv(malEnvPtr outer)
-: m_outer(outer)
+: m_outer(std::move(outer))
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
 malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
                malValueIter argsBegin, malValueIter argsEnd)
-: m_outer(outer)
+: m_outer(std::move(outer))
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
     int n = bindings.size();
@@ -30,6 +30,36 @@ malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
     MAL_CHECK(it == argsEnd, "Too many parameters");
 }
 
+malEnv::malEnv(malEnvPtr outer, const malScopePtr& scope)
+: m_scope(scope)
+, m_slots(scope->size())
+, m_outer(std::move(outer))
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+}
+
+malEnv::malEnv(malEnvPtr outer, const malScopePtr& scope,
+               malValueIter argsBegin, malValueIter argsEnd)
+: m_scope(scope)
+, m_slots(scope->size())
+, m_outer(std::move(outer))
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    const std::vector<int>& bindings = scope->bindings();
+    int fixed = bindings.size() - (scope->isVariadic() ? 1 : 0);
+    auto it = argsBegin;
+    for (int i = 0; i < fixed; i++) {
+        MAL_CHECK(it != argsEnd, "Not enough parameters");
+        m_slots[bindings[i]] = *it;
+        ++it;
+    }
+    if (scope->isVariadic()) {
+        m_slots[bindings[fixed]] = mal::list(it, argsEnd);
+        return;
+    }
+    MAL_CHECK(it == argsEnd, "Too many parameters");
+}
+
 malEnv::~malEnv()
 {
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
@@ -37,8 +67,9 @@ malEnv::~malEnv()
 
 malEnvPtr malEnv::find(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        auto it = env->m_map.find(symbol);
+        if ((it != env->m_map.end()) && it->second) {
             return env;
         }
     }
@@ -47,25 +78,74 @@ malEnvPtr malEnv::find(const String& symbol)
 
 malValuePtr malEnv::get(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
         auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
+        if ((it != env->m_map.end()) && it->second) {
             return it->second;
         }
     }
     MAL_FAIL("'%s' not found", symbol.c_str());
 }
 
-malValuePtr malEnv::set(const String& symbol, malValuePtr value)
+malValuePtr malEnv::set(const String& symbol, const malValuePtr& value)
 {
     m_map[symbol] = value;
     return value;
 }
 
+malValuePtr malEnv::get(const malSymbol* symbol)
+{
+    malValuePtr value = lookup(symbol);
+    MAL_CHECK(value, "'%s' not found", symbol->value().c_str());
+    return value;
+}
+
+malValuePtr malEnv::lookup(const malSymbol* symbol)
+{
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (env->m_scope) {
+            int slot = env->m_scope->find(symbol);
+            if ((slot >= 0) && (slot < static_cast<int>(env->m_slots.size()))
+                && env->m_slots[slot]) {
+                return env->m_slots[slot];
+            }
+        }
+        else {
+            auto it = env->m_map.find(symbol->value());
+            if ((it != env->m_map.end()) && it->second) {
+                return it->second;
+            }
+        }
+    }
+    return NULL;
+}
+
+malValuePtr malEnv::set(const malSymbol* symbol, const malValuePtr& value)
+{
+    if (m_scope) {
+        return setSlot(m_scope->add(symbol), value);
+    }
+    m_map[symbol->value()] = value;
+    return value;
+}
+
+malValuePtr malEnv::setSlot(int slot, const malValuePtr& value)
+{
+    if (slot >= static_cast<int>(m_slots.size())) {
+        m_slots.resize(slot + 1);
+    }
+    return m_slots[slot] = value;
+}
+
+const malValuePtr* malEnv::cell(const malSymbol* symbol)
+{
+    return &m_map[symbol->value()];
+}
+
 malEnvPtr malEnv::getRoot()
 {
     // Work our way down the the global environment.
-    for (malEnvPtr env = this; ; env = env->m_outer) {
+    for (malEnv* env = this; ; env = env->m_outer.ptr()) {
         if (!env->m_outer) {
             return env;
         }
@@ -5,6 +5,12 @@
 
 #include <map>
 
+class malSymbol;
+
+// There are two kinds of frame. The global environment, and every frame in
+// the earlier steps, maps names to values. The frames which stepA makes for
+// fn*, let* and catch* are flat arrays of slots, laid out by a malScope, so
+// that analyzed code can address a binding by its frame depth and slot.
 class malEnv : public RefCounted {
 public:
     malEnv(malEnvPtr outer = NULL);
@@ -12,18 +18,62 @@ public:
            const StringVec& bindings,
            malValueIter argsBegin,
            malValueIter argsEnd);
+    malEnv(malEnvPtr outer, const malScopePtr& scope);
+    malEnv(malEnvPtr outer,
+           const malScopePtr& scope,
+           malValueIter argsBegin,
+           malValueIter argsEnd);
 
     ~malEnv();
 
+    // These only see the named frames.
     malValuePtr get(const String& symbol);
     malEnvPtr   find(const String& symbol);
-    malValuePtr set(const String& symbol, malValuePtr value);
+    malValuePtr set(const String& symbol, const malValuePtr& value);
     malEnvPtr   getRoot();
 
+    // These see both kinds of frame. The symbol must be the interned one.
+    malValuePtr get(const malSymbol* symbol);
+    malValuePtr lookup(const malSymbol* symbol); // NULL if not found
+    malValuePtr set(const malSymbol* symbol, const malValuePtr& value);
+
+    // Access to slot frames by depth and slot, for analyzed code.
+    malValuePtr get(int depth, int slot, const malSymbol* symbol);
+    malValuePtr setSlot(int slot, const malValuePtr& value);
+
+    // Named frames never move or remove a binding once it's made, so the
+    // value in the map can serve as the binding's cell. This makes an
+    // unbound (NULL) cell for a name which hasn't been defined yet.
+    const malValuePtr* cell(const malSymbol* symbol);
+
+    const malScopePtr& scope() const { return m_scope; }
+    const malEnvPtr& outer() const { return m_outer; }
+
 private:
-    typedef std::map<String, malValuePtr> Map;
+    typedef std::map<String, malValuePtr, std::less<String>,
+                     PoolAllocator<std::pair<const String, malValuePtr> > >
+        Map;
     Map m_map;
+    malScopePtr m_scope;
+    malValueVec m_slots;
     malEnvPtr m_outer;
 };
 
+inline malValuePtr malEnv::get(int depth, int slot, const malSymbol* symbol)
+{
+    malEnv* env = this;
+    while (depth-- > 0) {
+        env = env->m_outer.ptr();
+    }
+    if (slot < static_cast<int>(env->m_slots.size())) {
+        const malValuePtr& value = env->m_slots[slot];
+        if (value) {
+            return value;
+        }
+    }
+    // Not bound yet, as with a reference to a let* binding before it has
+    // been evaluated. The name may still be bound further out.
+    return env->m_outer->get(symbol);
+}
+
 #endif // INCLUDE_ENVIRONMENT_H
@@ -10,23 +10,34 @@
 
 class malValue;
 typedef RefCountedPtr<malValue>  malValuePtr;
-typedef std::vector<malValuePtr> malValueVec;
+
+// Integers which fit in 62 bits are held directly in a malValuePtr.
+template<>
+struct ImmediateTraits<malValue> {
+    static const bool enabled = true;
+    static malValue* box(intptr_t value); // Types.cpp
+};
+typedef std::vector<malValuePtr, PoolAllocator<malValuePtr> > malValueVec;
 typedef malValueVec::iterator    malValueIter;
 
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
 
+class malScope;
+typedef RefCountedPtr<malScope>   malScopePtr;
+
 // step*.cpp
-extern malValuePtr APPLY(malValuePtr op,
+extern malValuePtr APPLY(const malValuePtr& op,
                          malValueIter argsBegin, malValueIter argsEnd);
 extern malValuePtr EVAL(malValuePtr ast, malEnvPtr env);
 extern malValuePtr readline(const String& prompt);
-extern String rep(const String& input, malEnvPtr env);
+extern String rep(const String& input, const malEnvPtr& env);
 
 // Core.cpp
-extern void installCore(malEnvPtr env);
+extern void installCore(const malEnvPtr& env);
 
 // Reader.cpp
-extern malValuePtr readStr(const String& input);
+extern malValuePtr readStr(StringView input);
+extern bool readStr(StringView input, size_t& offset, malValuePtr& form);
 
 #endif // INCLUDE_MAL_H
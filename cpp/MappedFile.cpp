@@ -0,0 +1,45 @@
+#include "MappedFile.h"
+#include "Validation.h"
+
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const String& filename)
+: m_mapping(NULL)
+, m_mappingSize(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    MAL_CHECK(fd >= 0, "Cannot open %s", filename.c_str());
+
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            m_mapping = mapping;
+            m_mappingSize = st.st_size;
+        }
+    }
+    close(fd);
+
+    if (m_mapping != NULL) {
+        m_contents = StringView((const char*)m_mapping, m_mappingSize);
+        return;
+    }
+
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename.c_str());
+    m_buffer.append(std::istreambuf_iterator<char>(file.rdbuf()),
+                    std::istreambuf_iterator<char>());
+    m_contents = m_buffer;
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_mapping != NULL) {
+        munmap(m_mapping, m_mappingSize);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef INCLUDE_MAPPEDFILE_H
+#define INCLUDE_MAPPEDFILE_H
+
+#include "RefCountedPtr.h"
+#include "String.h"
+
+// The read-only contents of a file. Regular files are mapped into memory
+// rather than copied onto the heap; anything that can't be mapped (pipes,
+// devices, empty files) is read into a buffer instead.
+//
+// A mapping shows any later change to the file, and truncating the file
+// makes reading past its new end raise SIGBUS. So only hold one for as
+// long as it's being read, and copy anything that needs to last longer.
+class MappedFile : public RefCounted {
+public:
+    MappedFile(const String& filename);
+    ~MappedFile();
+
+    StringView contents() const { return m_contents; }
+
+private:
+    void*       m_mapping;
+    size_t      m_mappingSize;
+    String      m_buffer;
+    StringView  m_contents;
+};
+
+typedef RefCountedPtr<MappedFile> MappedFilePtr;
+
+#endif // INCLUDE_MAPPEDFILE_H
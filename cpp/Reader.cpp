@@ -1,34 +1,118 @@
 #include "MAL.h"
 #include "Types.h"
 
-#include <regex>
+#include <memory>
+
+// Character classes used by the tokeniser. These mirror the old regular
+// expressions:
+//      whitespace  [\s,]+|;.*
+//      special     ~@ | [\[\]{}()'`~^@]
+//      string      "(?:\\.|[^\\"])*"
+//      atom        [^\s\[\]{}('"`,;)]+
+enum CharClass {
+    CC_ATOM = 0,        // anything that can appear in a symbol or number
+    CC_WHITESPACE,      // [\s,]
+    CC_COMMENT,         // ;
+    CC_SPECIAL,         // [\[\]{}()'`~^@]
+    CC_QUOTE,           // "
+};
 
-typedef std::regex              Regex;
+class CharClassTable
+{
+public:
+    CharClassTable() {
+        for (int i = 0; i < 256; i++) {
+            m_table[i] = CC_ATOM;
+        }
+        for (const char* p = " \t\n\v\f\r,"; *p; p++) {
+            m_table[(unsigned char)*p] = CC_WHITESPACE;
+        }
+        for (const char* p = "[]{}()'`~^@"; *p; p++) {
+            m_table[(unsigned char)*p] = CC_SPECIAL;
+        }
+        m_table[(unsigned char)';'] = CC_COMMENT;
+        m_table[(unsigned char)'"'] = CC_QUOTE;
+    }
 
-static const Regex intRegex("^[-+]?\\d+$");
-static const Regex closeRegex("[\\)\\]}]");
+    CharClass operator [] (char c) const {
+        return m_table[(unsigned char)c];
+    }
 
-static const Regex whitespaceRegex("[\\s,]+|;.*");
-static const Regex tokenRegexes[] = {
-    Regex("~@"),
-    Regex("[\\[\\]{}()'`~^@]"),
-    Regex("\"(?:\\\\.|[^\\\\\"])*\""),
-    Regex("[^\\s\\[\\]{}('\"`,;)]+"),
+private:
+    CharClass m_table[256];
 };
 
+static const CharClassTable charClass;
+
+static bool isAtomChar(char c)
+{
+    // ~, ^ and @ are only special at the start of a token.
+    CharClass cc = charClass[c];
+    return (cc == CC_ATOM) || (c == '~') || (c == '^') || (c == '@');
+}
+
+static bool isInteger(StringView token)
+{
+    const char* it = token.begin();
+    const char* end = token.end();
+    if ((it != end) && ((*it == '-') || (*it == '+'))) {
+        ++it;
+    }
+    if (it == end) {
+        return false;
+    }
+    for ( ; it != end; ++it) {
+        if ((*it < '0') || (*it > '9')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int64_t parseInteger(StringView token)
+{
+    const char* it = token.begin();
+    bool negative = (*it == '-');
+    if ((*it == '-') || (*it == '+')) {
+        ++it;
+    }
+    // Built up as a negative number, which has room for the most negative.
+    int64_t value = 0;
+    bool overflow = false;
+    for ( ; it != token.end(); ++it) {
+        overflow |= __builtin_mul_overflow(value, 10, &value);
+        overflow |= __builtin_sub_overflow(value, *it - '0', &value);
+    }
+    if (!negative) {
+        overflow |= __builtin_mul_overflow(value, -1, &value);
+    }
+    MAL_CHECK(!overflow, "Integer out of range: %.*s",
+              static_cast<int>(token.size()), token.data());
+    return value;
+}
+
+static bool isClose(StringView token)
+{
+    return (token.size() == 1) &&
+        ((token[0] == ')') || (token[0] == ']') || (token[0] == '}'));
+}
+
+// Tokens are views into the input buffer, which must outlive the
+// tokeniser. Nothing is copied until the reader builds a value that needs
+// to own its characters.
 class Tokeniser
 {
 public:
-    Tokeniser(const String& input);
+    Tokeniser(StringView input);
 
-    String peek() const {
+    StringView peek() const {
         ASSERT(!eof(), "Tokeniser reading past EOF in peek\n");
         return m_token;
     }
 
-    String next() {
+    StringView next() {
         ASSERT(!eof(), "Tokeniser reading past EOF in next\n");
-        String ret = peek();
+        StringView ret = peek();
         nextToken();
         return ret;
     }
@@ -37,88 +121,111 @@ public:
         return m_iter == m_end;
     }
 
+    // The start of the current token, or the end of the input at EOF.
+    const char* position() const {
+        return m_iter;
+    }
+
 private:
     void skipWhitespace();
     void nextToken();
 
-    bool matchRegex(const Regex& regex);
+    typedef const char* StringIter;
 
-    typedef String::const_iterator StringIter;
+    StringIter scanString(StringIter it) const;
 
-    String      m_token;
+    StringView  m_token;
     StringIter  m_iter;
     StringIter  m_end;
 };
 
-Tokeniser::Tokeniser(const String& input)
+Tokeniser::Tokeniser(StringView input)
 :   m_iter(input.begin())
 ,   m_end(input.end())
 {
     nextToken();
 }
 
-bool Tokeniser::matchRegex(const Regex& regex)
-{
-    if (eof()) {
-        return false;
-    }
-
-    std::smatch match;
-    auto flags = std::regex_constants::match_continuous;
-    if (!std::regex_search(m_iter, m_end, match, regex, flags)) {
-        return false;
-    }
-
-    ASSERT(match.size() == 1, "Should only have one submatch, not %lu\n",
-                              match.size());
-    ASSERT(match.position(0) == 0, "Need to match first character\n");
-    ASSERT(match.length(0) > 0, "Need to match a non-empty string\n");
-
-    // Don't advance  m_iter now, do it after we've consumed the token in
-    // next().  If we do it now, we hit eof() when there's still one token left.
-    m_token = match.str(0);
-
-    return true;
-}
-
 void Tokeniser::nextToken()
 {
+    // Don't advance m_iter until we've consumed the token in next(). If we
+    // do it early, we hit eof() when there's still one token left.
     m_iter += m_token.size();
+    m_token = StringView();
 
     skipWhitespace();
     if (eof()) {
         return;
     }
 
-    for (auto &it : tokenRegexes) {
-        if (matchRegex(it)) {
-            return;
-        }
+    StringIter it = m_iter;
+    switch (charClass[*it]) {
+        case CC_SPECIAL:
+            ++it;
+            if ((*m_iter == '~') && (it != m_end) && (*it == '@')) {
+                ++it;
+            }
+            break;
+
+        case CC_QUOTE:
+            it = scanString(it);
+            MAL_CHECK(it != m_end, "Expected \", got EOF");
+            ++it;
+            break;
+
+        default:
+            while ((it != m_end) && isAtomChar(*it)) {
+                ++it;
+            }
+            break;
     }
 
-    String mismatch(m_iter, m_end);
-    if (mismatch[0] == '"') {
-        MAL_CHECK(false, "Expected \", got EOF");
-    }
-    else {
-        MAL_CHECK(false, "Unexpected \"%s\"", mismatch.c_str());
+    m_token = StringView(m_iter, it);
+}
+
+// Returns an iterator pointing at the closing double-quote, or m_end if
+// the string is unterminated.
+Tokeniser::StringIter Tokeniser::scanString(StringIter it) const
+{
+    for (++it; ; ++it) {
+        it = findAny(it, m_end, '"', '\\', '"');
+        if ((it == m_end) || (*it == '"')) {
+            return it;
+        }
+        // The escaped character may not be a line terminator.
+        ++it;
+        if ((it == m_end) || (*it == '\n') || (*it == '\r')) {
+            return m_end;
+        }
     }
 }
 
 void Tokeniser::skipWhitespace()
 {
-    while (matchRegex(whitespaceRegex)) {
-        m_iter += m_token.size();
+    while (!eof()) {
+        switch (charClass[*m_iter]) {
+            case CC_WHITESPACE:
+                ++m_iter;
+                break;
+
+            case CC_COMMENT:
+                while (!eof() && (*m_iter != '\n') && (*m_iter != '\r')) {
+                    ++m_iter;
+                }
+                break;
+
+            default:
+                return;
+        }
     }
 }
 
 static malValuePtr readAtom(Tokeniser& tokeniser);
 static malValuePtr readForm(Tokeniser& tokeniser);
-static void readList(Tokeniser& tokeniser, malValueVec* items,
-                      const String& end);
-static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol);
+static void readList(Tokeniser& tokeniser, malValueVec* items, char end);
+static malValuePtr processMacro(Tokeniser& tokeniser, const char* symbol);
 
-malValuePtr readStr(const String& input)
+malValuePtr readStr(StringView input)
 {
     Tokeniser tokeniser(input);
     if (tokeniser.eof()) {
@@ -127,30 +234,42 @@ malValuePtr readStr(const String& input)
     return readForm(tokeniser);
 }
 
+bool readStr(StringView input, size_t& offset, malValuePtr& form)
+{
+    Tokeniser tokeniser(input.substr(offset, input.size() - offset));
+    if (tokeniser.eof()) {
+        offset = input.size();
+        return false;
+    }
+    form = readForm(tokeniser);
+    offset = tokeniser.position() - input.data();
+    return true;
+}
+
 static malValuePtr readForm(Tokeniser& tokeniser)
 {
     MAL_CHECK(!tokeniser.eof(), "Expected form, got EOF");
-    String token = tokeniser.peek();
+    StringView token = tokeniser.peek();
 
-    MAL_CHECK(!std::regex_match(token, closeRegex),
-            "Unexpected \"%s\"", token.c_str());
+    MAL_CHECK(!isClose(token),
+            "Unexpected \"%s\"", token.str().c_str());
 
     if (token == "(") {
         tokeniser.next();
         std::unique_ptr<malValueVec> items(new malValueVec);
-        readList(tokeniser, items.get(), ")");
+        readList(tokeniser, items.get(), ')');
         return mal::list(items.release());
     }
     if (token == "[") {
         tokeniser.next();
         std::unique_ptr<malValueVec> items(new malValueVec);
-        readList(tokeniser, items.get(), "]");
+        readList(tokeniser, items.get(), ']');
         return mal::vector(items.release());
     }
     if (token == "{") {
         tokeniser.next();
         malValueVec items;
-        readList(tokeniser, &items, "}");
+        readList(tokeniser, &items, '}');
         return mal::hash(items.begin(), items.end(), false);
     }
     return readAtom(tokeniser);
@@ -162,7 +281,7 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
         const char* token;
         const char* symbol;
     };
-    ReaderMacro macroTable[] = {
+    static const ReaderMacro macroTable[] = {
         { "@",   "deref" },
         { "`",   "quasiquote" },
         { "'",   "quote" },
@@ -174,13 +293,13 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
         const char* token;
         malValuePtr value;
     };
-    Constant constantTable[] = {
+    static const Constant constantTable[] = {
         { "false",  mal::falseValue()  },
         { "nil",    mal::nilValue()          },
         { "true",   mal::trueValue()   },
     };
 
-    String token = tokeniser.next();
+    StringView token = tokeniser.next();
     if (token[0] == '"') {
         return mal::string(unescape(token));
     }
@@ -203,18 +322,18 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
             return processMacro(tokeniser, macro.symbol);
         }
     }
-    if (std::regex_match(token, intRegex)) {
-        return mal::integer(token);
+    if (isInteger(token)) {
+        return mal::integer(parseInteger(token));
     }
     return mal::symbol(token);
 }
 
-static void readList(Tokeniser& tokeniser, malValueVec* items,
-                      const String& end)
+static void readList(Tokeniser& tokeniser, malValueVec* items, char end)
 {
     while (1) {
-        MAL_CHECK(!tokeniser.eof(), "Expected \"%s\", got EOF", end.c_str());
-        if (tokeniser.peek() == end) {
+        MAL_CHECK(!tokeniser.eof(), "Expected \"%c\", got EOF", end);
+        StringView token = tokeniser.peek();
+        if ((token.size() == 1) && (token[0] == end)) {
             tokeniser.next();
             return;
         }
@@ -222,7 +341,7 @@ static void readList(Tokeniser& tokeniser, malValueVec* items,
     }
 }
 
-static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol)
+static malValuePtr processMacro(Tokeniser& tokeniser, const char* symbol)
 {
     return mal::list(mal::symbol(symbol), readForm(tokeniser));
 }
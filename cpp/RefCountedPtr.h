@@ -1,19 +1,52 @@
 #ifndef INCLUDE_REFCOUNTEDPTR_H
 #define INCLUDE_REFCOUNTEDPTR_H
 
+#include "Allocator.h"
 #include "Debug.h"
 
 #include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#if DEBUG_REFCOUNT_STATS
+    // Counts reference count increments, and moves which stood in for one.
+    // The function-local static is shared by every translation unit, and
+    // reports when it is destroyed at exit.
+    struct RefCountStats {
+        unsigned long acquires;
+        unsigned long moves;
+
+        RefCountStats() : acquires(0), moves(0) { }
+        ~RefCountStats() {
+            TRACE("refcounts: %lu acquires, %lu moves\n", acquires, moves);
+        }
+
+        static RefCountStats& get() {
+            static RefCountStats stats;
+            return stats;
+        }
+    };
+
+    #define COUNT_REFCOUNT(counter) RefCountStats::get().counter++
+#else
+    #define COUNT_REFCOUNT(counter) NOOP
+#endif
 
 class RefCounted {
 public:
     RefCounted() : m_refCount(0) { }
     virtual ~RefCounted() { }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
+    const RefCounted* acquire() const {
+        COUNT_REFCOUNT(acquires);
+        m_refCount++;
+        return this;
+    }
     int release() const { return --m_refCount; }
     int refCount() const { return m_refCount; }
 
+    POOL_ALLOCATED;
+
 private:
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
@@ -21,6 +54,17 @@ private:
     mutable int m_refCount;
 };
 
+// A RefCountedPtr<T> can hold a small integer directly instead of a
+// pointer, if T opts in by specialising ImmediateTraits. Immediates have
+// the low two bits of the pointer set to 01, leaving 62 bits for the value.
+// box() makes a heap object for an immediate, for the rare occasions when
+// something needs to call a member function on it.
+template<class T>
+struct ImmediateTraits {
+    static const bool enabled = false;
+    static T* box(intptr_t value) { return NULL; }
+};
+
 template<class T>
 class RefCountedPtr {
 public:
@@ -32,11 +76,28 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    // Moves hand the reference over without touching the count.
+    RefCountedPtr(RefCountedPtr&& rhs) : m_object(rhs.m_object) {
+        rhs.m_object = 0;
+        countMove();
+    }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
         acquire(rhs.m_object);
         return *this;
     }
 
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) {
+        if (this != &rhs) {
+            T* object = rhs.m_object;
+            rhs.m_object = 0;
+            release();
+            m_object = object;
+            countMove();
+        }
+        return *this;
+    }
+
     bool operator == (const RefCountedPtr& rhs) const {
         return m_object == rhs.m_object;
     }
@@ -53,12 +114,74 @@ public:
         release();
     }
 
-    T* operator -> () const { return m_object; }
+    static const intptr_t immediateMin = INTPTR_MIN >> 2;
+    static const intptr_t immediateMax = INTPTR_MAX >> 2;
+
+    static bool fitsImmediate(int64_t value) {
+        return ImmediateTraits<T>::enabled &&
+            (value >= immediateMin) && (value <= immediateMax);
+    }
+
+    static RefCountedPtr immediate(intptr_t value) {
+        RefCountedPtr ptr;
+        ptr.m_object = reinterpret_cast<T*>(
+            (static_cast<uintptr_t>(value) << 2) | 1);
+        return ptr;
+    }
+
+    bool isImmediate() const { return isImmediate(m_object); }
+
+    intptr_t immediateValue() const {
+        return reinterpret_cast<intptr_t>(m_object) >> 2;
+    }
+
+    // Member access through an immediate goes via a temporary boxed
+    // object, which lives until the end of the full expression.
+    class Arrow {
+    public:
+        Arrow(T* object, bool isBoxed)
+            : m_object(object), m_isBoxed(isBoxed) { }
+        Arrow(const Arrow& that)
+            : m_object(that.m_object), m_isBoxed(that.m_isBoxed) {
+            if (m_isBoxed) {
+                m_object->acquire();
+            }
+        }
+        ~Arrow() {
+            if (m_isBoxed && (m_object->release() == 0)) {
+                delete m_object;
+            }
+        }
+
+        T* operator -> () const { return m_object; }
+
+    private:
+        Arrow& operator = (const Arrow&); // no assignments
+
+        T* m_object;
+        bool m_isBoxed;
+    };
+
+    Arrow operator -> () const {
+        if (isImmediate()) {
+            T* boxed = ImmediateTraits<T>::box(immediateValue());
+            boxed->acquire();
+            return Arrow(boxed, true);
+        }
+        return Arrow(m_object, false);
+    }
+
+    // Not valid for immediates.
     T* ptr() const { return m_object; }
 
 private:
+    static bool isImmediate(T* object) {
+        return ImmediateTraits<T>::enabled &&
+            ((reinterpret_cast<intptr_t>(object) & 3) == 1);
+    }
+
     void acquire(T* object) {
-        if (object != NULL) {
+        if ((object != NULL) && !isImmediate(object)) {
             object->acquire();
         }
         release();
@@ -66,11 +189,18 @@ private:
     }
 
     void release() {
-        if ((m_object != NULL) && (m_object->release() == 0)) {
+        if ((m_object != NULL) && !isImmediate(m_object) &&
+            (m_object->release() == 0)) {
             delete m_object;
         }
     }
 
+    void countMove() const {
+        if ((m_object != NULL) && !isImmediate(m_object)) {
+            COUNT_REFCOUNT(moves);
+        }
+    }
+
     T* m_object;
 };
 
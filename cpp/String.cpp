@@ -2,10 +2,17 @@
 #include "String.h"
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // Adapted from: http://stackoverflow.com/questions/2342162
 String stringPrintf(const char* fmt, ...) {
     int size = strlen(fmt); // make a guess
@@ -35,23 +42,75 @@ String copyAndFree(char* mallocedString)
     return ret;
 }
 
-String escape(const String& in)
+// Scans a block at a time where the compiler allows it. GCC and Clang
+// define __SSE2__ for all x86-64 targets, and __AVX2__ given -mavx2 or a
+// -march which has it.
+const char* findAny(const char* p, const char* end, char a, char b, char c)
+{
+#if defined(__AVX2__)
+    const __m256i a32 = _mm256_set1_epi8(a);
+    const __m256i b32 = _mm256_set1_epi8(b);
+    const __m256i c32 = _mm256_set1_epi8(c);
+    for ( ; end - p >= 32; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, a32),
+                            _mm256_cmpeq_epi8(block, b32)),
+            _mm256_cmpeq_epi8(block, c32));
+        uint32_t mask = _mm256_movemask_epi8(hits);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i a16 = _mm_set1_epi8(a);
+    const __m128i b16 = _mm_set1_epi8(b);
+    const __m128i c16 = _mm_set1_epi8(c);
+    for ( ; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, a16),
+                         _mm_cmpeq_epi8(block, b16)),
+            _mm_cmpeq_epi8(block, c16));
+        uint32_t mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for ( ; p != end; ++p) {
+        if (*p == a || *p == b || *p == c) {
+            return p;
+        }
+    }
+    return end;
+}
+
+String escape(StringView in)
 {
     String out;
-    out.reserve(in.size() * 2 + 2); // each char may get escaped + two "'s
+    out.reserve(in.size() + 2); // grows as needed for any escapes
+    escape(in, out);
+    return out;
+}
+
+void escape(StringView in, String& out)
+{
     out += '"';
-    for (auto it = in.begin(), end = in.end(); it != end; ++it) {
-        char c = *it;
-        switch (c) {
-            case '\\': out += "\\\\"; break;
-            case '\n': out += "\\n"; break;
-            case '"':  out += "\\\""; break;
-            default:   out += c;      break;
-        };
+    const char* p = in.begin();
+    const char* end = in.end();
+    while (true) {
+        const char* special = findAny(p, end, '\\', '\n', '"');
+        out.append(p, special);
+        if (special == end) {
+            break;
+        }
+        out += '\\';
+        out += (*special == '\n') ? 'n' : *special;
+        p = special + 1;
     }
     out += '"';
-    out.shrink_to_fit();
-    return out;
 }
 
 static char unescape(char c)
@@ -64,25 +123,22 @@ static char unescape(char c)
     }
 }
 
-String unescape(const String& in)
+String unescape(StringView in)
 {
     String out;
     out.reserve(in.size()); // unescaped string will always be shorter
 
-    // in will have double-quotes at either end, so move the iterators in
-    for (auto it = in.begin()+1, end = in.end()-1; it != end; ++it) {
-        char c = *it;
-        if (c == '\\') {
-            ++it;
-            if (it != end) {
-                out += unescape(*it);
-            }
-        }
-        else {
-            out += c;
+    // in will have double-quotes at either end, so move the pointers in
+    const char* p = in.begin() + 1;
+    const char* end = in.end() - 1;
+    while (true) {
+        const char* slash = findAny(p, end, '\\', '\\', '\\');
+        out.append(p, slash);
+        if (slash == end || slash + 1 == end) {
+            break;
         }
+        out += unescape(slash[1]);
+        p = slash + 2;
     }
-    out.shrink_to_fit();
     return out;
 }
-
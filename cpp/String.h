@@ -1,6 +1,7 @@
 #ifndef INCLUDE_STRING_H
 #define INCLUDE_STRING_H
 
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -10,9 +11,65 @@ typedef std::vector<String> StringVec;
 #define STRF        stringPrintf
 #define PLURAL(n)   &("s"[(n)==1])
 
+// A non-owning view of a run of characters, in the style of
+// std::string_view. The referenced characters must outlive the view.
+class StringView {
+public:
+    StringView() : m_data(NULL), m_size(0) { }
+    StringView(const char* data, size_t size) : m_data(data), m_size(size) { }
+    StringView(const char* begin, const char* end)
+        : m_data(begin), m_size(end - begin) { }
+    StringView(const char* s) : m_data(s), m_size(strlen(s)) { }
+    StringView(const String& s) : m_data(s.data()), m_size(s.size()) { }
+
+    const char* data()  const { return m_data; }
+    size_t      size()  const { return m_size; }
+    bool        empty() const { return m_size == 0; }
+
+    const char* begin() const { return m_data; }
+    const char* end()   const { return m_data + m_size; }
+
+    char operator [] (size_t index) const { return m_data[index]; }
+
+    StringView substr(size_t pos, size_t count) const {
+        return StringView(m_data + pos, count);
+    }
+
+    String str() const { return String(m_data, m_size); }
+
+    bool operator == (const StringView& rhs) const {
+        return (m_size == rhs.m_size) &&
+               (memcmp(m_data, rhs.m_data, m_size) == 0);
+    }
+
+    bool operator != (const StringView& rhs) const {
+        return !(*this == rhs);
+    }
+
+private:
+    const char* m_data;
+    size_t      m_size;
+};
+
+// FNV-1a, for using StringViews as keys in unordered containers.
+struct StringViewHash {
+    size_t operator () (const StringView& s) const {
+        size_t hash = 2166136261u;
+        for (const char* p = s.begin(), *end = s.end(); p != end; ++p) {
+            hash = (hash ^ (unsigned char)*p) * 16777619u;
+        }
+        return hash;
+    }
+};
+
 extern String stringPrintf(const char* fmt, ...);
+
+// Returns the first of the characters a, b or c in [p, end), or end.
+extern const char* findAny(const char* p, const char* end,
+                           char a, char b, char c);
 extern String copyAndFree(char* mallocedString);
-extern String escape(const String& s);
-extern String unescape(const String& s);
+extern String escape(StringView s);
+extern void escape(StringView s, String& out); // appends to out
+extern String unescape(StringView s);
 
 #endif // INCLUDE_STRING_H
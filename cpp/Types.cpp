@@ -3,12 +3,42 @@
 #include "Types.h"
 
 #include <algorithm>
+#include <climits>
 #include <memory>
-#include <typeinfo>
+#include <ostream>
+#include <unordered_map>
+
+// Maps each name to its one immortal instance. The keys are views into
+// the interned objects' own strings.
+template<class T>
+class InternTable {
+public:
+    T* intern(StringView name) {
+        auto it = m_map.find(name);
+        if (it != m_map.end()) {
+            return it->second;
+        }
+        T* value = new T(name.str());
+        value->acquire(); // never released
+        m_map[value->view()] = value;
+        return value;
+    }
+
+private:
+    std::unordered_map<StringView, T*, StringViewHash> m_map;
+};
+
+// Room for a million arguments: the pages are only touched as it fills.
+malArgStack malArgs::s_stack(1 << 20);
+
+void malArgStack::overflow()
+{
+    MAL_FAIL("Stack overflow");
+}
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
-        return malValuePtr(new malAtom(value));
+        return malValuePtr(new malAtom(std::move(value)));
     };
 
     malValuePtr boolean(bool value) {
@@ -25,30 +55,33 @@ namespace mal {
     };
 
 
-    malValuePtr hash(const malHash::Map& map) {
-        return malValuePtr(new malHash(map));
-    }
-
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated) {
         return malValuePtr(new malHash(argsBegin, argsEnd, isEvaluated));
     }
 
     malValuePtr integer(int64_t value) {
+        if (malValuePtr::fitsImmediate(value)) {
+            return malValuePtr::immediate(value);
+        }
         return malValuePtr(new malInteger(value));
     };
 
-    malValuePtr integer(const String& token) {
-        return integer(std::stoi(token));
-    };
-
-    malValuePtr keyword(const String& token) {
-        return malValuePtr(new malKeyword(token));
+    malValuePtr keyword(StringView token) {
+        static InternTable<malKeyword> keywords;
+        return keywords.intern(token);
     };
 
     malValuePtr lambda(const StringVec& bindings,
                        malValuePtr body, malEnvPtr env) {
-        return malValuePtr(new malLambda(bindings, body, env));
+        return malValuePtr(new malLambda(bindings, std::move(body),
+                                         std::move(env)));
+    }
+
+    malValuePtr lambda(const malScopePtr& scope,
+                       malValuePtr body, malEnvPtr env) {
+        return malValuePtr(new malLambda(scope, std::move(body),
+                                         std::move(env)));
     }
 
     malValuePtr list(malValueVec* items) {
@@ -61,22 +94,22 @@ namespace mal {
 
     malValuePtr list(malValuePtr a) {
         malValueVec* items = new malValueVec(1);
-        items->at(0) = a;
+        items->at(0) = std::move(a);
         return malValuePtr(new malList(items));
     }
 
     malValuePtr list(malValuePtr a, malValuePtr b) {
         malValueVec* items = new malValueVec(2);
-        items->at(0) = a;
-        items->at(1) = b;
+        items->at(0) = std::move(a);
+        items->at(1) = std::move(b);
         return malValuePtr(new malList(items));
     }
 
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c) {
         malValueVec* items = new malValueVec(3);
-        items->at(0) = a;
-        items->at(1) = b;
-        items->at(2) = c;
+        items->at(0) = std::move(a);
+        items->at(1) = std::move(b);
+        items->at(2) = std::move(c);
         return malValuePtr(new malList(items));
     }
 
@@ -89,12 +122,13 @@ namespace mal {
         return malValuePtr(c);
     };
 
-    malValuePtr string(const String& token) {
-        return malValuePtr(new malString(token));
+    malValuePtr string(String token) {
+        return malValuePtr(new malString(std::move(token)));
     }
 
-    malValuePtr symbol(const String& token) {
-        return malValuePtr(new malSymbol(token));
+    malValuePtr symbol(StringView token) {
+        static InternTable<malSymbol> symbols;
+        return symbols.intern(token);
     };
 
     malValuePtr trueValue() {
@@ -103,7 +137,8 @@ namespace mal {
     };
 
     malValuePtr vector(malValueVec* items) {
-        return malValuePtr(new malVector(items));
+        std::unique_ptr<malValueVec> owned(items);
+        return malValuePtr(new malVector(items->begin(), items->end()));
     };
 
     malValuePtr vector(malValueIter begin, malValueIter end) {
@@ -111,178 +146,544 @@ namespace mal {
     };
 };
 
+bool mal::equal(const malValuePtr& lhs, const malValuePtr& rhs)
+{
+    if (lhs == rhs) {
+        return true;
+    }
+    if (lhs.isImmediate() || rhs.isImmediate()) {
+        return isInteger(lhs) && isInteger(rhs) &&
+            (INTEGER_CAST(lhs) == INTEGER_CAST(rhs));
+    }
+    return lhs->isEqualTo(rhs.ptr());
+}
+
+static uint32_t hashInteger(int64_t value)
+{
+    return static_cast<uint32_t>(value ^ (value >> 32));
+}
+
+uint32_t mal::hashOf(const malValuePtr& value)
+{
+    if (value.isImmediate()) {
+        return hashInteger(value.immediateValue());
+    }
+    return value->hash();
+}
+
+String mal::print(const malValuePtr& value, bool readably)
+{
+    malPrinter out(readably);
+    out.print(value);
+    return std::move(out.str());
+}
+
+void malPrinter::print(const malValuePtr& value)
+{
+    if (value.isImmediate()) {
+        write(std::to_string(value.immediateValue()));
+    }
+    else {
+        value->printTo(*this);
+    }
+}
+
+const malValuePtr* malPrinter::s_maxLength = NULL;
+const malValuePtr* malPrinter::s_maxLevel = NULL;
+
+// A limit is off unless it's set to a non-negative integer. Those too big
+// for an int are clamped, rather than cut down to their low bits.
+static int printLimit(const malValuePtr* cell)
+{
+    if (!cell || !*cell || !isInteger(*cell)) {
+        return -1;
+    }
+    int64_t limit = INTEGER_CAST(*cell);
+    if (limit < 0) {
+        return -1;
+    }
+    return static_cast<int>(std::min<int64_t>(limit, INT_MAX));
+}
+
+malPrinter::malPrinter(bool readably)
+: m_stream(NULL)
+, m_readably(readably)
+, m_maxLength(-1)
+, m_maxLevel(-1)
+, m_level(0)
+{
+
+}
+
+malPrinter::malPrinter(std::ostream& stream, bool readably)
+: m_stream(&stream)
+, m_readably(readably)
+, m_maxLength(-1)
+, m_maxLevel(-1)
+, m_level(0)
+{
+
+}
+
+void malPrinter::setLimits(const malValuePtr* maxLength,
+                           const malValuePtr* maxLevel)
+{
+    s_maxLength = maxLength;
+    s_maxLevel = maxLevel;
+}
+
+bool malPrinter::open(char bracket)
+{
+    // The limits are read as each outermost collection starts, rather than
+    // when the printer is made, so that the form being printed can set them.
+    if (m_level == 0) {
+        m_maxLength = printLimit(s_maxLength);
+        m_maxLevel = printLimit(s_maxLevel);
+    }
+    if (m_maxLevel >= 0 && m_level >= m_maxLevel) {
+        write("...");
+        return false;
+    }
+    m_level++;
+    write(bracket);
+    return true;
+}
+
+void malPrinter::close(char bracket)
+{
+    m_level--;
+    write(bracket);
+}
+
+bool malPrinter::item(int index)
+{
+    if (index > 0) {
+        write(' ');
+    }
+    if (m_maxLength >= 0 && index >= m_maxLength) {
+        write("...");
+        return false;
+    }
+    return true;
+}
+
+void malPrinter::writeEscaped(StringView text)
+{
+    escape(text, m_buffer);
+    checkFlush();
+}
+
+void malPrinter::flush()
+{
+    if (m_stream && !m_buffer.empty()) {
+        m_stream->write(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
+    }
+}
+
+malValue* ImmediateTraits<malValue>::box(intptr_t value)
+{
+    return new malInteger(value);
+}
+
+uint32_t malInteger::hash() const
+{
+    return hashInteger(m_value);
+}
+
+void malAtom::printTo(malPrinter& out) const
+{
+    out.write("(atom ");
+    out.print(m_value);
+    out.write(')');
+}
+
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
     return m_handler(m_name, argsBegin, argsEnd);
 }
 
-static String makeHashKey(malValuePtr key)
+// Each level of the trie takes five bits of the hash. Past the last of
+// them, a node is just a list of the keys whose hashes are all equal.
+static const int HashBits = 5;
+static const int HashMask = (1 << HashBits) - 1;
+static const int HashDepth = 32;
+
+struct malHashEntry {
+    malHashEntry() : hash(0) { }
+    malHashEntry(uint32_t hash, const malValuePtr& key,
+                 const malValuePtr& value)
+    : hash(hash), key(key), value(value) { }
+
+    uint32_t hash;
+    malValuePtr key;
+    malValuePtr value;
+    RefCountedPtr<malHashNode> child;   // if set, the others are unused
+};
+
+// The entries are in hash order, one for each bit set in the bitmap.
+class malHashNode : public RefCounted {
+public:
+    malHashNode() : bitmap(0) { }
+    malHashNode(const malHashNode& that)
+    : bitmap(that.bitmap), entries(that.entries) { }
+
+    uint32_t bitmap;
+    std::vector<malHashEntry> entries;
+};
+
+static uint32_t hashBit(uint32_t hash, int shift)
+{
+    return 1u << ((hash >> shift) & HashMask);
+}
+
+static int entryIndex(uint32_t bitmap, uint32_t bit)
 {
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
+    return __builtin_popcount(bitmap & (bit - 1));
+}
+
+// As with vectors, nodes are copied before they're changed, unless this
+// is the only reference to them.
+static malHashNode* editableNode(RefCountedPtr<malHashNode>& node)
+{
+    if (node->refCount() > 1) {
+        node = new malHashNode(*node.ptr());
     }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
+    return node.ptr();
+}
+
+static const malHashEntry* findEntry(const malHashNode* node,
+                                     uint32_t hash, const malValuePtr& key)
+{
+    for (int shift = 0; node; shift += HashBits) {
+        if (shift >= HashDepth) {
+            for (auto& entry : node->entries) {
+                if (mal::equal(entry.key, key)) {
+                    return &entry;
+                }
+            }
+            return NULL;
+        }
+        uint32_t bit = hashBit(hash, shift);
+        if ((node->bitmap & bit) == 0) {
+            return NULL;
+        }
+        const malHashEntry& entry =
+            node->entries[entryIndex(node->bitmap, bit)];
+        if (!entry.child) {
+            bool isMatch = entry.hash == hash && mal::equal(entry.key, key);
+            return isMatch ? &entry : NULL;
+        }
+        node = entry.child.ptr();
     }
-    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
+    return NULL;
 }
 
-static malHash::Map addToMap(malHash::Map& map,
-    malValueIter argsBegin, malValueIter argsEnd)
+// Returns true if the key wasn't already there.
+static bool assocIn(RefCountedPtr<malHashNode>& ref, int shift,
+                    uint32_t hash, const malValuePtr& key,
+                    const malValuePtr& value)
 {
-    // This is intended to be called with pre-evaluated arguments.
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
-        map[key] = *it;
+    malHashNode* node = editableNode(ref);
+    if (shift >= HashDepth) {
+        for (auto& entry : node->entries) {
+            if (mal::equal(entry.key, key)) {
+                entry.value = value;
+                return false;
+            }
+        }
+        node->entries.push_back(malHashEntry(hash, key, value));
+        return true;
+    }
+
+    uint32_t bit = hashBit(hash, shift);
+    int index = entryIndex(node->bitmap, bit);
+    if ((node->bitmap & bit) == 0) {
+        node->bitmap |= bit;
+        node->entries.insert(node->entries.begin() + index,
+                             malHashEntry(hash, key, value));
+        return true;
+    }
+
+    malHashEntry& entry = node->entries[index];
+    if (entry.child) {
+        return assocIn(entry.child, shift + HashBits, hash, key, value);
+    }
+    if (entry.hash == hash && mal::equal(entry.key, key)) {
+        entry.value = value;
+        return false;
     }
 
-    return map;
+    // Two keys share this slot, so move them both down a level.
+    RefCountedPtr<malHashNode> child(new malHashNode);
+    assocIn(child, shift + HashBits, entry.hash, entry.key, entry.value);
+    assocIn(child, shift + HashBits, hash, key, value);
+    entry = malHashEntry();
+    entry.child = child;
+    return true;
 }
 
-static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
+// The key must be there.
+static void dissocIn(RefCountedPtr<malHashNode>& ref, int shift,
+                     uint32_t hash, const malValuePtr& key)
+{
+    malHashNode* node = editableNode(ref);
+    if (shift >= HashDepth) {
+        for (auto it = node->entries.begin(); ; ++it) {
+            if (mal::equal(it->key, key)) {
+                node->entries.erase(it);
+                return;
+            }
+        }
+    }
+
+    uint32_t bit = hashBit(hash, shift);
+    int index = entryIndex(node->bitmap, bit);
+    malHashEntry& entry = node->entries[index];
+    if (!entry.child) {
+        node->bitmap &= ~bit;
+        node->entries.erase(node->entries.begin() + index);
+        return;
+    }
+
+    dissocIn(entry.child, shift + HashBits, hash, key);
+
+    // Pull a lone key back up, so that lookups don't go further than they
+    // need to.
+    const malHashNode* child = entry.child.ptr();
+    if (child->entries.size() == 1 && !child->entries[0].child) {
+        malHashEntry lone = child->entries[0];
+        entry = lone;
+    }
+}
+
+template<class F>
+static void forEachEntry(const malHashNode* node, F f)
+{
+    for (auto& entry : node->entries) {
+        if (entry.child) {
+            forEachEntry(entry.child.ptr(), f);
+        }
+        else {
+            f(entry);
+        }
+    }
+}
+
+// Returns whether f is true for every entry, stopping at the first which
+// it's false for.
+template<class F>
+static bool allEntries(const malHashNode* node, F f)
+{
+    for (auto& entry : node->entries) {
+        if (entry.child ? !allEntries(entry.child.ptr(), f) : !f(entry)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+malHash::malHash()
+: malValue(MAL_HASH)
+, m_root(new malHashNode)
+, m_count(0)
+, m_isEvaluated(true)
+, m_hash(0)
 {
-    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
-            "hash-map requires an even-sized list");
 
-    malHash::Map map;
-    return addToMap(map, argsBegin, argsEnd);
 }
 
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
-: m_map(createMap(argsBegin, argsEnd))
+: malValue(MAL_HASH)
+, m_root(new malHashNode)
+, m_count(0)
 , m_isEvaluated(isEvaluated)
+, m_hash(0)
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "hash-map requires an even-sized list");
+
+    // This is intended to be called with pre-evaluated arguments.
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        set(*it, *(it + 1));
+    }
+}
+
+malHash::malHash(const malHash& that, const malValuePtr& meta)
+: malValue(MAL_HASH, meta)
+, m_root(that.m_root)
+, m_count(that.m_count)
+, m_isEvaluated(that.m_isEvaluated)
+, m_hash(that.m_hash)
 {
 
 }
 
-malHash::malHash(const malHash::Map& map)
-: m_map(map)
-, m_isEvaluated(true)
+malHash::~malHash()
 {
 
 }
 
+void malHash::set(const malValuePtr& key, const malValuePtr& value)
+{
+    if (assocIn(m_root, 0, mal::hashOf(key), key, value)) {
+        m_count++;
+    }
+}
+
 malValuePtr
 malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "assoc requires an even-sized list");
 
-    malHash::Map map(m_map);
-    return mal::hash(addToMap(map, argsBegin, argsEnd));
+    malHash* hash = new malHash();
+    hash->m_root = m_root;
+    hash->m_count = m_count;
+    malValuePtr result(hash);
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        hash->set(*it, *(it + 1));
+    }
+    return result;
 }
 
-bool malHash::contains(malValuePtr key) const
+bool malHash::contains(const malValuePtr& key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    return findEntry(m_root.ptr(), mal::hashOf(key), key) != NULL;
 }
 
 malValuePtr
 malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    malHash::Map map(m_map);
+    malHash* hash = new malHash();
+    hash->m_root = m_root;
+    hash->m_count = m_count;
+    malValuePtr result(hash);
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
+        uint32_t keyHash = mal::hashOf(*it);
+        if (findEntry(hash->m_root.ptr(), keyHash, *it)) {
+            dissocIn(hash->m_root, 0, keyHash, *it);
+            hash->m_count--;
+        }
     }
-    return mal::hash(map);
+    return result;
 }
 
-malValuePtr malHash::eval(malEnvPtr env)
+malValuePtr malHash::eval(const malEnvPtr& env)
 {
     if (m_isEvaluated) {
         return malValuePtr(this);
     }
 
-    malHash::Map map;
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
-    }
-    return mal::hash(map);
+    malHash* hash = new malHash();
+    malValuePtr result(hash);
+    forEachEntry(m_root.ptr(), [&](const malHashEntry& entry) {
+        hash->set(EVAL(entry.key, env), EVAL(entry.value, env));
+    });
+    return result;
 }
 
-malValuePtr malHash::get(malValuePtr key) const
+malValuePtr malHash::get(const malValuePtr& key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? mal::nilValue() : it->second;
+    const malHashEntry* entry = findEntry(m_root.ptr(), mal::hashOf(key), key);
+    return entry ? entry->value : mal::nilValue();
 }
 
 malValuePtr malHash::keys() const
 {
     malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
-    }
+    keys->reserve(m_count);
+    forEachEntry(m_root.ptr(), [&](const malHashEntry& entry) {
+        keys->push_back(entry.key);
+    });
     return mal::list(keys);
 }
 
 malValuePtr malHash::values() const
 {
-    malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        keys->push_back(it->second);
-    }
-    return mal::list(keys);
+    malValueVec* values = new malValueVec();
+    values->reserve(m_count);
+    forEachEntry(m_root.ptr(), [&](const malHashEntry& entry) {
+        values->push_back(entry.value);
+    });
+    return mal::list(values);
 }
 
-String malHash::print(bool readably) const
+void malHash::printTo(malPrinter& out) const
 {
-    String s = "{";
-
-    auto it = m_map.begin(), end = m_map.end();
-    if (it != end) {
-        s += it->first + " " + it->second->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
+    if (!out.open('{')) {
+        return;
     }
+    int index = 0;
+    allEntries(m_root.ptr(), [&](const malHashEntry& entry) {
+        if (!out.item(index++)) {
+            return false;
+        }
+        out.print(entry.key);
+        out.write(' ');
+        out.print(entry.value);
+        return true;
+    });
+    out.close('}');
+}
 
-    return s + "}";
+uint32_t malHash::hash() const
+{
+    if (m_hash == 0) {
+        // Summed, so that the order the keys are found in doesn't matter.
+        uint32_t hash = 0;
+        forEachEntry(m_root.ptr(), [&](const malHashEntry& entry) {
+            hash += entry.hash * 31 + mal::hashOf(entry.value);
+        });
+        m_hash = hash ? hash : 1;
+    }
+    return m_hash;
 }
 
 bool malHash::doIsEqualTo(const malValue* rhs) const
 {
-    const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
-    if (m_map.size() != r_map.size()) {
+    const malHash* r_hash = static_cast<const malHash*>(rhs);
+    if (m_count != r_hash->m_count) {
         return false;
     }
-
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
-
-        if (it0->first != it1->first) {
-            return false;
-        }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
-            return false;
-        }
+    if (m_hash && r_hash->m_hash && m_hash != r_hash->m_hash) {
+        return false;
     }
-    return true;
+
+    return allEntries(m_root.ptr(), [&](const malHashEntry& entry) {
+        const malHashEntry* r_entry =
+            findEntry(r_hash->m_root.ptr(), entry.hash, entry.key);
+        return r_entry && mal::equal(entry.value, r_entry->value);
+    });
 }
 
 malLambda::malLambda(const StringVec& bindings,
                      malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
-, m_body(body)
-, m_env(env)
+: malApplicable(MAL_LAMBDA)
+, m_bindings(bindings)
+, m_body(std::move(body))
+, m_env(std::move(env))
 , m_isMacro(false)
 {
 
 }
 
-malLambda::malLambda(const malLambda& that, malValuePtr meta)
-: malApplicable(meta)
+malLambda::malLambda(const malScopePtr& scope,
+                     malValuePtr body, malEnvPtr env)
+: malApplicable(MAL_LAMBDA)
+, m_scope(scope)
+, m_body(std::move(body))
+, m_env(std::move(env))
+, m_isMacro(false)
+{
+
+}
+
+malLambda::malLambda(const malLambda& that, const malValuePtr& meta)
+: malApplicable(MAL_LAMBDA, meta)
 , m_bindings(that.m_bindings)
+, m_scope(that.m_scope)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(that.m_isMacro)
@@ -291,8 +692,9 @@ malLambda::malLambda(const malLambda& that, malValuePtr meta)
 }
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
+: malApplicable(MAL_LAMBDA, that.m_meta)
 , m_bindings(that.m_bindings)
+, m_scope(that.m_scope)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(isMacro)
@@ -306,30 +708,103 @@ malValuePtr malLambda::apply(malValueIter argsBegin,
     return EVAL(m_body, makeEnv(argsBegin, argsEnd));
 }
 
-malValuePtr malLambda::doWithMeta(malValuePtr meta) const
+malValuePtr malLambda::doWithMeta(const malValuePtr& meta) const
 {
     return new malLambda(*this, meta);
 }
 
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
 {
+    if (m_scope) {
+        return malEnvPtr(new malEnv(m_env, m_scope, argsBegin, argsEnd));
+    }
     return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
 }
 
+class malListBuffer : public RefCounted {
+public:
+    malListBuffer(int capacity) { items.reserve(capacity); }
+
+    bool hasRoom() const { return items.size() < items.capacity(); }
+
+    malValueVec items; // never grows beyond its capacity
+};
+
+static const malValuePtr* firstItem(malListBuffer* buffer, int count)
+{
+    return count == 0 ? NULL : &buffer->items[count - 1];
+}
+
+malList::malList(malValueVec* items)
+: malSequence(MAL_LIST, items->size())
+, m_buffer(new malListBuffer(0))
+{
+    std::reverse(items->begin(), items->end());
+    m_buffer->items.swap(*items);
+    m_first = firstItem(m_buffer.ptr(), m_count);
+    delete items;
+}
+
+malList::malList(malValueIter begin, malValueIter end)
+: malSequence(MAL_LIST, std::distance(begin, end))
+, m_buffer(new malListBuffer(m_count))
+{
+    m_buffer->items.assign(std::reverse_iterator<malValueIter>(end),
+                           std::reverse_iterator<malValueIter>(begin));
+    m_first = firstItem(m_buffer.ptr(), m_count);
+}
+
+malList::malList(const malList& that, const malValuePtr& meta)
+: malSequence(that, meta)
+, m_buffer(that.m_buffer)
+, m_first(that.m_first)
+{
+
+}
+
+malList::malList(const RefCountedPtr<malListBuffer>& buffer, int count)
+: malSequence(MAL_LIST, count)
+, m_buffer(buffer)
+, m_first(firstItem(buffer.ptr(), count))
+{
+
+}
+
+malList::~malList()
+{
+
+}
+
+malValuePtr malList::cons(const malValuePtr& item) const
+{
+    malListBuffer* buffer = m_buffer.ptr();
+    if ((buffer->items.size() != static_cast<size_t>(m_count)) ||
+        !buffer->hasRoom()) {
+        // Copy into a new buffer, with room to grow.
+        buffer = new malListBuffer(std::max(2 * m_count, 4));
+        buffer->items.assign(m_buffer->items.begin(),
+                             m_buffer->items.begin() + m_count);
+    }
+    buffer->items.push_back(item);
+    return new malList(buffer, m_count + 1);
+}
+
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
-
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::reverse_copy(argsBegin, argsEnd, items->begin());
-    std::copy(begin(), end(), items->begin() + newItemCount);
+    malValuePtr list(const_cast<malList*>(this));
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        list = STATIC_CAST(malList, list)->cons(*it);
+    }
+    return list;
+}
 
-    return mal::list(items);
+malValuePtr malList::rest() const
+{
+    return new malList(m_buffer, m_count > 0 ? m_count - 1 : 0);
 }
 
-malValuePtr malList::eval(malEnvPtr env)
+malValuePtr malList::eval(const malEnvPtr& env)
 {
     // Note, this isn't actually called since the TCO updates, but
     // is required for the earlier steps, so don't get rid of it.
@@ -337,18 +812,17 @@ malValuePtr malList::eval(malEnvPtr env)
         return malValuePtr(this);
     }
 
-    std::unique_ptr<malValueVec> items(evalItems(env));
-    auto it = items->begin();
-    malValuePtr op = *it;
-    return APPLY(op, ++it, items->end());
+    malArgs items;
+    evalItems(env, items);
+    return APPLY(items[0], items.begin() + 1, items.end());
 }
 
-String malList::print(bool readably) const
+void malList::printTo(malPrinter& out) const
 {
-    return '(' + malSequence::print(readably) + ')';
+    printItems(out, '(', ')');
 }
 
-malValuePtr malValue::eval(malEnvPtr env)
+malValuePtr malValue::eval(const malEnvPtr& env)
 {
     // Default case of eval is just to return the object itself.
     return malValuePtr(this);
@@ -356,14 +830,29 @@ malValuePtr malValue::eval(malEnvPtr env)
 
 bool malValue::isEqualTo(const malValue* rhs) const
 {
+    if (this == rhs) {
+        return true;
+    }
+
     // Special-case. Vectors and Lists can be compared.
-    bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
-        (dynamic_cast<const malSequence*>(this) &&
-         dynamic_cast<const malSequence*>(rhs));
+    bool matchingTypes = (m_type == rhs->m_type) ||
+        (malSequence::classof(this) && malSequence::classof(rhs));
 
     return matchingTypes && doIsEqualTo(rhs);
 }
 
+String malValue::print(bool readably) const
+{
+    malPrinter out(readably);
+    printTo(out);
+    return std::move(out.str());
+}
+
+uint32_t malValue::hash() const
+{
+    return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(this) >> 4);
+}
+
 bool malValue::isTrue() const
 {
     return (this != mal::falseValue().ptr())
@@ -375,124 +864,394 @@ malValuePtr malValue::meta() const
     return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
 }
 
-malValuePtr malValue::withMeta(malValuePtr meta) const
+malValuePtr malValue::withMeta(const malValuePtr& meta) const
 {
     return doWithMeta(meta);
 }
 
-malSequence::malSequence(malValueVec* items)
-: m_items(items)
+uint32_t malSequence::hash() const
+{
+    if (m_hash == 0) {
+        uint32_t hash = 1;
+        for (int i = 0; i < m_count; i++) {
+            hash = hash * 31 + mal::hashOf(item(i));
+        }
+        m_hash = hash ? hash : 1;
+    }
+    return m_hash;
+}
+
+bool malSequence::doIsEqualTo(const malValue* rhs) const
 {
+    const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
+    if (count() != rhsSeq->count()) {
+        return false;
+    }
+    // Either hash is only known if it's been needed already.
+    if (m_hash && rhsSeq->m_hash && m_hash != rhsSeq->m_hash) {
+        return false;
+    }
 
+    for (int i = 0; i < m_count; i++) {
+        if (!mal::equal(item(i), rhsSeq->item(i))) {
+            return false;
+        }
+    }
+    return true;
 }
 
-malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+void malSequence::evalItems(const malEnvPtr& env, malArgs& args) const
 {
+    for (int i = 0; i < m_count; i++) {
+        args.push(EVAL(item(i), env));
+    }
+}
 
+void malSequence::pushItems(malArgs& args, int start) const
+{
+    for (int i = start; i < m_count; i++) {
+        args.push(item(i));
+    }
 }
 
-malSequence::malSequence(const malSequence& that, malValuePtr meta)
-: malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+malValuePtr malSequence::first() const
 {
+    return count() == 0 ? mal::nilValue() : item(0);
+}
 
+void malSequence::printItems(malPrinter& out, char open, char close) const
+{
+    if (!out.open(open)) {
+        return;
+    }
+    for (int i = 0; i < m_count && out.item(i); i++) {
+        out.print(item(i));
+    }
+    out.close(close);
 }
 
-malSequence::~malSequence()
+malValuePtr malSequence::rest() const
 {
-    delete m_items;
+    malValueVec* items = new malValueVec;
+    if (m_count > 1) {
+        items->reserve(m_count - 1);
+        for (int i = 1; i < m_count; i++) {
+            items->push_back(item(i));
+        }
+    }
+    return mal::list(items);
 }
 
-bool malSequence::doIsEqualTo(const malValue* rhs) const
+uint32_t malStringBase::hash() const
 {
-    const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
-    if (count() != rhsSeq->count()) {
+    if (m_hash == 0) {
+        m_hash = static_cast<uint32_t>(StringViewHash()(view()));
+        if (m_hash == 0) {
+            m_hash = 1;
+        }
+    }
+    return m_hash;
+}
+
+bool malString::doIsEqualTo(const malValue* rhs) const
+{
+    const malString* rhsString = static_cast<const malString*>(rhs);
+    if (m_hash && rhsString->m_hash && m_hash != rhsString->m_hash) {
         return false;
     }
+    return view() == rhsString->view();
+}
 
-    for (malValueIter it0 = m_items->begin(),
-                      it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
+// Strings shorter than this are just copied, as most of them are never
+// appended to again.
+static const size_t MinBufferSize = 64;
 
-        if (! (*it0)->isEqualTo((*it1).ptr())) {
-            return false;
+malValuePtr malString::append(StringView tail) const
+{
+    if (m_buffer && m_buffer->text.size() == m_size) {
+        m_buffer->text.append(tail.data(), tail.size());
+        return new malString(m_buffer, m_buffer->text.size());
+    }
+
+    StringView head = view();
+    size_t size = head.size() + tail.size();
+    if (size < MinBufferSize) {
+        String text;
+        text.reserve(size);
+        text.append(head.data(), head.size());
+        text.append(tail.data(), tail.size());
+        return mal::string(std::move(text));
+    }
+
+    malStringBufferPtr buffer(new malStringBuffer);
+    buffer->text.reserve(2 * size);
+    buffer->text.append(head.data(), head.size());
+    buffer->text.append(tail.data(), tail.size());
+    return new malString(buffer, size);
+}
+
+void malString::printTo(malPrinter& out) const
+{
+    if (out.isReadable()) {
+        out.writeEscaped(view());
+    }
+    else {
+        out.write(view());
+    }
+}
+
+int malScope::add(const malSymbol* symbol)
+{
+    int slot = find(symbol);
+    if (slot < 0) {
+        slot = m_names.size();
+        m_names.push_back(symbol);
+    }
+    return slot;
+}
+
+int malScope::find(const malSymbol* symbol) const
+{
+    for (int i = 0, n = m_names.size(); i < n; i++) {
+        if (m_names[i] == symbol) {
+            return i;
         }
     }
-    return true;
+    return -1;
+}
+
+malValuePtr malSymbol::eval(const malEnvPtr& env)
+{
+    return env->get(m_interned);
+}
+
+// The nodes of a vector's trie. Branches hold up to 32 nodes of the level
+// below; leaves hold up to 32 items.
+static const int VectorBits = 5;
+static const int VectorWidth = 1 << VectorBits;
+static const int VectorMask = VectorWidth - 1;
+
+class malVectorLeaf : public RefCounted {
+public:
+    malVectorLeaf() { }
+    malVectorLeaf(const malVectorLeaf& that, int count) {
+        std::copy(that.items, that.items + count, items);
+    }
+
+    malValuePtr items[VectorWidth];
+};
+
+class malVectorBranch : public RefCounted {
+public:
+    malVectorBranch() { }
+    malVectorBranch(const malVectorBranch& that) {
+        std::copy(that.children, that.children + VectorWidth, children);
+    }
+
+    RefCountedPtr<RefCounted> children[VectorWidth];
+};
+
+// Nodes are shared between vectors, and copied before they're changed,
+// unless this is the only reference to them, as when building a vector.
+static malVectorBranch* editableBranch(RefCountedPtr<RefCounted>& node)
+{
+    malVectorBranch* branch = static_cast<malVectorBranch*>(node.ptr());
+    if (branch->refCount() > 1) {
+        branch = new malVectorBranch(*branch);
+        node = branch;
+    }
+    return branch;
 }
 
-malValueVec* malSequence::evalItems(malEnvPtr env) const
+static malVectorLeaf* editableLeaf(RefCountedPtr<RefCounted>& node)
 {
-    malValueVec* items = new malValueVec;;
-    items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
-        items->push_back(EVAL(*it, env));
+    malVectorLeaf* leaf = static_cast<malVectorLeaf*>(node.ptr());
+    if (leaf->refCount() > 1) {
+        leaf = new malVectorLeaf(*leaf, VectorWidth);
+        node = leaf;
     }
-    return items;
+    return leaf;
 }
 
-malValuePtr malSequence::first() const
+// Returns a chain of branches down to the leaf, for a new subtree of the
+// given level.
+static RefCountedPtr<RefCounted> newPath(int level, malVectorLeaf* leaf)
 {
-    return count() == 0 ? mal::nilValue() : item(0);
+    if (level == 0) {
+        return leaf;
+    }
+    malVectorBranch* branch = new malVectorBranch;
+    branch->children[0] = newPath(level - VectorBits, leaf);
+    return branch;
 }
 
-String malSequence::print(bool readably) const
+// Adds a full leaf, whose first item has the given index, to a subtree
+// which has room for it.
+static void pushLeaf(RefCountedPtr<RefCounted>& node, int level, int index,
+                     malVectorLeaf* leaf)
 {
-    String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
-    if (it != end) {
-        str += (*it)->print(readably);
-        ++it;
+    malVectorBranch* branch = editableBranch(node);
+    RefCountedPtr<RefCounted>& child =
+        branch->children[(index >> level) & VectorMask];
+    if (level == VectorBits) {
+        child = leaf;
+    }
+    else if (!child) {
+        child = newPath(level - VectorBits, leaf);
     }
-    for ( ; it != end; ++it) {
-        str += " ";
-        str += (*it)->print(readably);
+    else {
+        pushLeaf(child, level - VectorBits, index, leaf);
     }
-    return str;
 }
 
-malValuePtr malSequence::rest() const
+static void assocIn(RefCountedPtr<RefCounted>& node, int level, int index,
+                    const malValuePtr& value)
+{
+    if (level == 0) {
+        editableLeaf(node)->items[index & VectorMask] = value;
+        return;
+    }
+    malVectorBranch* branch = editableBranch(node);
+    assocIn(branch->children[(index >> level) & VectorMask],
+            level - VectorBits, index, value);
+}
+
+malVector::malVector()
+: malSequence(MAL_VECTOR, 0)
+, m_shift(0)
 {
-    malValueIter start = (count() > 0) ? begin() + 1 : end();
-    return mal::list(start, end());
+
 }
 
-String malString::escapedValue() const
+malVector::malVector(malValueIter begin, malValueIter end)
+: malSequence(MAL_VECTOR, 0)
+, m_shift(0)
 {
-    return escape(value());
+    for (auto it = begin; it != end; ++it) {
+        push(*it);
+    }
 }
 
-String malString::print(bool readably) const
+malVector::malVector(const malVector& that, const malValuePtr& meta)
+: malSequence(that, meta)
+, m_root(that.m_root)
+, m_shift(that.m_shift)
+, m_tail(that.m_tail)
 {
-    return readably ? escapedValue() : value();
+
 }
 
-malValuePtr malSymbol::eval(malEnvPtr env)
+malVector::~malVector()
 {
-    return env->get(value());
+
 }
 
-malValuePtr malVector::conj(malValueIter argsBegin,
-                            malValueIter argsEnd) const
+int malVector::tailOffset() const
+{
+    return m_count < VectorWidth ? 0 : ((m_count - 1) & ~VectorMask);
+}
+
+const malValuePtr& malVector::item(int index) const
+{
+    if (index >= tailOffset()) {
+        return m_tail->items[index & VectorMask];
+    }
+    const RefCounted* node = m_root.ptr();
+    for (int level = m_shift; level > 0; level -= VectorBits) {
+        const malVectorBranch* branch =
+            static_cast<const malVectorBranch*>(node);
+        node = branch->children[(index >> level) & VectorMask].ptr();
+    }
+    return static_cast<const malVectorLeaf*>(node)->items[index & VectorMask];
+}
+
+// Only for vectors which haven't been seen by anything else yet.
+void malVector::push(const malValuePtr& value)
+{
+    int tailCount = m_count - tailOffset();
+    if (tailCount == VectorWidth) {
+        // Move the full tail into the trie, adding a level if it's full.
+        int leafCount = (m_count - VectorWidth) >> VectorBits;
+        if (!m_root) {
+            m_root = m_tail.ptr();
+        }
+        else if (leafCount == (1 << m_shift)) {
+            malVectorBranch* branch = new malVectorBranch;
+            branch->children[0] = m_root;
+            branch->children[1] = newPath(m_shift, m_tail.ptr());
+            m_root = branch;
+            m_shift += VectorBits;
+        }
+        else {
+            pushLeaf(m_root, m_shift, m_count - VectorWidth, m_tail.ptr());
+        }
+        m_tail = new malVectorLeaf;
+        tailCount = 0;
+    }
+    else if (!m_tail) {
+        m_tail = new malVectorLeaf;
+    }
+    else if (m_tail->refCount() > 1) {
+        m_tail = new malVectorLeaf(*m_tail.ptr(), tailCount);
+    }
+    m_tail->items[tailCount] = value;
+    m_count++;
+    m_hash = 0; // forget any copied from the vector this was made from
+}
+
+// As for push, and can also append.
+void malVector::set(int index, const malValuePtr& value)
+{
+    if (index == m_count) {
+        push(value);
+    }
+    else if (index >= tailOffset()) {
+        if (m_tail->refCount() > 1) {
+            m_tail = new malVectorLeaf(*m_tail.ptr(), m_count - tailOffset());
+        }
+        m_tail->items[index & VectorMask] = value;
+    }
+    else {
+        assocIn(m_root, m_shift, index, value);
+    }
+    m_hash = 0;
+}
+
+malValuePtr
+malVector::assoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::copy(begin(), end(), items->begin());
-    std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
+    malVector* vector = new malVector(*this, malValuePtr());
+    malValuePtr result(vector);
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        int64_t index = INTEGER_CAST(*it);
+        MAL_CHECK(index >= 0 && index <= vector->count(),
+                  "Index out of range");
+        vector->set(index, *(it + 1));
+    }
+    return result;
+}
 
-    return mal::vector(items);
+malValuePtr malVector::conj(malValueIter argsBegin,
+                            malValueIter argsEnd) const
+{
+    malVector* vector = new malVector(*this, malValuePtr());
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        vector->push(*it);
+    }
+    return vector;
 }
 
-malValuePtr malVector::eval(malEnvPtr env)
+malValuePtr malVector::eval(const malEnvPtr& env)
 {
-    return mal::vector(evalItems(env));
+    malArgs items;
+    evalItems(env, items);
+    return mal::vector(items.begin(), items.end());
 }
 
-String malVector::print(bool readably) const
+void malVector::printTo(malPrinter& out) const
 {
-    return '[' + malSequence::print(readably) + ']';
+    printItems(out, '[', ']');
 }
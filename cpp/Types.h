@@ -4,64 +4,182 @@
 #include "MAL.h"
 
 #include <exception>
-#include <map>
+#include <iosfwd>
 
 class malEmptyInputException : public std::exception { };
 
+class malArgs;
+
+// Values print themselves to a malPrinter, which either collects the text,
+// or writes it to a stream a block at a time as it goes, so that printing
+// a value doesn't build the text of each part of it separately.
+//
+// Collections are cut short to the number of items in *print-length*, and
+// to the depth in *print-level*, if they're set, with "..." for the rest.
+class malPrinter {
+public:
+    explicit malPrinter(bool readably);
+    malPrinter(std::ostream& stream, bool readably);
+    ~malPrinter() { flush(); }
+
+    // The cells of the globals to take the limits from.
+    static void setLimits(const malValuePtr* maxLength,
+                          const malValuePtr* maxLevel);
+
+    bool isReadable() const { return m_readably; }
+
+    void print(const malValuePtr& value);
+
+    // A collection prints its items between these. open() returns false,
+    // having elided the collection, if it's too deep. item() writes the
+    // separator before an item, and returns false, having elided the
+    // rest, if there are already as many as there can be.
+    bool open(char bracket);
+    bool item(int index);
+    void close(char bracket);
+
+    void write(char c) {
+        m_buffer += c;
+        checkFlush();
+    }
+    void write(StringView text) {
+        m_buffer.append(text.data(), text.size());
+        checkFlush();
+    }
+    void writeEscaped(StringView text);
+
+    // Passes any text held back on to the stream.
+    void flush();
+
+    // Everything printed, if there's no stream.
+    String& str() { return m_buffer; }
+
+private:
+    malPrinter(const malPrinter&) = delete;
+    malPrinter& operator = (const malPrinter&) = delete;
+
+    void checkFlush() {
+        if (m_stream && m_buffer.size() >= BlockSize) {
+            flush();
+        }
+    }
+
+    static const size_t BlockSize = 4096;
+
+    String m_buffer;
+    std::ostream* m_stream;
+    const bool m_readably;
+    int m_maxLength;            // -1 for no limit
+    int m_maxLevel;             // -1 for no limit
+    int m_level;
+
+    static const malValuePtr* s_maxLength;
+    static const malValuePtr* s_maxLevel;
+};
+
+// Every value carries its concrete type as a tag, so that type tests are a
+// load and a compare rather than RTTI. Types which share a base class are
+// kept contiguous, so that the base class can test for a range.
+enum malType {
+    MAL_CONSTANT,
+    MAL_INTEGER,
+    MAL_STRING,     // malStringBase: MAL_STRING..MAL_SYMBOL
+    MAL_KEYWORD,
+    MAL_SYMBOL,
+    MAL_LIST,       // malSequence: MAL_LIST..MAL_VECTOR
+    MAL_VECTOR,
+    MAL_HASH,
+    MAL_ATOM,
+    MAL_BUILTIN,    // malApplicable: MAL_BUILTIN..MAL_LAMBDA
+    MAL_LAMBDA,
+    MAL_NODE,       // Only found in analyzed code.
+};
+
 class malValue : public RefCounted {
 public:
-    malValue() {
+    malValue(malType type) : m_type(type) {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
-    malValue(malValuePtr meta) : m_meta(meta) {
+    malValue(malType type, const malValuePtr& meta)
+        : m_type(type), m_meta(meta) {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
     virtual ~malValue() {
         TRACE_OBJECT("Destroying malValue %p\n", this);
     }
 
-    malValuePtr withMeta(malValuePtr meta) const;
-    virtual malValuePtr doWithMeta(malValuePtr meta) const = 0;
+    malValuePtr withMeta(const malValuePtr& meta) const;
+    virtual malValuePtr doWithMeta(const malValuePtr& meta) const = 0;
     malValuePtr meta() const;
 
+    malType type() const { return m_type; }
+
     bool isTrue() const;
 
     bool isEqualTo(const malValue* rhs) const;
 
-    virtual malValuePtr eval(malEnvPtr env);
+    // Values which are equal have the same hash. By default that's the
+    // value's identity, which suits anything only equal to itself.
+    virtual uint32_t hash() const;
 
-    virtual String print(bool readably) const = 0;
+    virtual malValuePtr eval(const malEnvPtr& env);
+
+    // Returns the printed value, for messages and the like.
+    String print(bool readably) const;
+    virtual void printTo(malPrinter& out) const = 0;
 
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
+    const malType m_type;
     malValuePtr m_meta;
 };
 
 template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
-    T* dest = dynamic_cast<T*>(obj.ptr());
+inline bool isa(const malValue* obj) {
+    return (obj != NULL) && T::classof(obj);
+}
+
+template<class T>
+inline T* type_cast(const malValuePtr& obj) {
+    return !obj.isImmediate() && isa<T>(obj.ptr())
+        ? static_cast<T*>(obj.ptr()) : NULL;
+}
+
+template<class T>
+T* value_cast(const malValuePtr& obj, const char* typeName) {
+    T* dest = type_cast<T>(obj);
     MAL_CHECK(dest != NULL, "%s is not a %s",
               obj->print(true).c_str(), typeName);
     return dest;
 }
 
 #define VALUE_CAST(Type, Value)    value_cast<Type>(Value, #Type)
-#define DYNAMIC_CAST(Type, Value)  (dynamic_cast<Type*>((Value).ptr()))
+#define DYNAMIC_CAST(Type, Value)  type_cast<Type>(Value)
 #define STATIC_CAST(Type, Value)   (static_cast<Type*>((Value).ptr()))
 
+// Declares the classof() test used by isa<> and type_cast<>.
+#define TYPE_RANGE(first, last) \
+    static bool classof(const malValue* obj) { \
+        return (obj->type() >= first) && (obj->type() <= last); \
+    } \
+
+#define TYPE_TAG(tag) TYPE_RANGE(tag, tag)
+
 #define WITH_META(Type) \
-    virtual malValuePtr doWithMeta(malValuePtr meta) const { \
+    virtual malValuePtr doWithMeta(const malValuePtr& meta) const { \
         return new Type(*this, meta); \
     } \
 
 class malConstant : public malValue {
 public:
-    malConstant(String name) : m_name(name) { }
-    malConstant(const malConstant& that, malValuePtr meta)
-        : malValue(meta), m_name(that.m_name) { }
+    malConstant(String name) : malValue(MAL_CONSTANT), m_name(name) { }
+    malConstant(const malConstant& that, const malValuePtr& meta)
+        : malValue(MAL_CONSTANT, meta), m_name(that.m_name) { }
 
-    virtual String print(bool readably) const { return m_name; }
+    TYPE_TAG(MAL_CONSTANT);
+
+    virtual void printTo(malPrinter& out) const { out.write(m_name); }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // these are singletons
@@ -75,16 +193,20 @@ private:
 
 class malInteger : public malValue {
 public:
-    malInteger(int64_t value) : m_value(value) { }
-    malInteger(const malInteger& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+    malInteger(int64_t value) : malValue(MAL_INTEGER), m_value(value) { }
+    malInteger(const malInteger& that, const malValuePtr& meta)
+        : malValue(MAL_INTEGER, meta), m_value(that.m_value) { }
+
+    TYPE_TAG(MAL_INTEGER);
 
-    virtual String print(bool readably) const {
-        return std::to_string(m_value);
+    virtual void printTo(malPrinter& out) const {
+        out.write(std::to_string(m_value));
     }
 
     int64_t value() const { return m_value; }
 
+    virtual uint32_t hash() const;
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
     }
@@ -95,86 +217,167 @@ private:
     const int64_t m_value;
 };
 
-class malStringBase : public malValue {
+// Integers are usually immediates, but may be boxed in a malInteger if
+// they're too large, or have metadata.
+inline bool isInteger(const malValuePtr& obj) {
+    return obj.isImmediate() || isa<malInteger>(obj.ptr());
+}
+
+inline int64_t integer_cast(const malValuePtr& obj) {
+    if (obj.isImmediate()) {
+        return obj.immediateValue();
+    }
+    return VALUE_CAST(malInteger, obj)->value();
+}
+
+#define INTEGER_CAST(Value)        integer_cast(Value)
+
+// Immediates are always true, so they needn't be boxed to be asked.
+inline bool isTruthy(const malValuePtr& obj) {
+    return obj.isImmediate() || obj.ptr()->isTrue();
+}
+
+// The text of strings built up by str. Each of them is a prefix of the
+// buffer, so str can append to it in place for the one which is all of
+// it, without disturbing the others.
+class malStringBuffer : public RefCounted {
 public:
-    malStringBase(const String& token)
-        : m_value(token) { }
-    malStringBase(const malStringBase& that, malValuePtr meta)
-        : malValue(meta), m_value(that.value()) { }
+    String text;
+};
 
-    virtual String print(bool readably) const { return m_value; }
+typedef RefCountedPtr<malStringBuffer> malStringBufferPtr;
 
-    String value() const { return m_value; }
+class malStringBase : public malValue {
+public:
+    malStringBase(malType type, String token)
+        : malValue(type), m_value(std::move(token)), m_size(0), m_hash(0) { }
+    malStringBase(malType type, const malStringBufferPtr& buffer, size_t size)
+        : malValue(type), m_buffer(buffer), m_size(size), m_hash(0) { }
+    malStringBase(const malStringBase& that, const malValuePtr& meta)
+        : malValue(that.type(), meta), m_value(that.m_value)
+        , m_buffer(that.m_buffer), m_size(that.m_size)
+        , m_hash(that.m_hash) { }
+
+    TYPE_RANGE(MAL_STRING, MAL_SYMBOL);
+
+    virtual void printTo(malPrinter& out) const { out.write(view()); }
+
+    StringView view() const {
+        if (m_buffer) {
+            return StringView(m_buffer->text.data(), m_size);
+        }
+        return m_value;
+    }
 
-private:
+    // Worked out the first time it's asked for.
+    virtual uint32_t hash() const;
+
+protected:
     const String m_value;
+    const malStringBufferPtr m_buffer; // if set, the value is a prefix of it
+    const size_t m_size;               // of the prefix
+    mutable uint32_t m_hash;           // 0 until it's been worked out
 };
 
 class malString : public malStringBase {
 public:
-    malString(const String& token)
-        : malStringBase(token) { }
-    malString(const malString& that, malValuePtr meta)
+    malString(String token)
+        : malStringBase(MAL_STRING, std::move(token)) { }
+    malString(const malStringBufferPtr& buffer, size_t size)
+        : malStringBase(MAL_STRING, buffer, size) { }
+    malString(const malString& that, const malValuePtr& meta)
         : malStringBase(that, meta) { }
 
-    virtual String print(bool readably) const;
+    TYPE_TAG(MAL_STRING);
 
-    String escapedValue() const;
+    virtual void printTo(malPrinter& out) const;
 
-    virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malString*>(rhs)->value();
-    }
+    virtual bool doIsEqualTo(const malValue* rhs) const;
+
+    // Returns this string with the tail added. That appends to this
+    // string's buffer in place, if it's the whole of it.
+    malValuePtr append(StringView tail) const;
 
     WITH_META(malString);
 };
 
+// Keywords and symbols are interned: mal::keyword() and mal::symbol()
+// return the one immortal object for each name, so they can be compared
+// by identity. Copies made by with-meta keep a pointer to the original.
 class malKeyword : public malStringBase {
 public:
-    malKeyword(const String& token)
-        : malStringBase(token) { }
-    malKeyword(const malKeyword& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+    malKeyword(String token)
+        : malStringBase(MAL_KEYWORD, std::move(token)), m_interned(this) { }
+    malKeyword(const malKeyword& that, const malValuePtr& meta)
+        : malStringBase(that, meta), m_interned(that.m_interned) { }
+
+    TYPE_TAG(MAL_KEYWORD);
+
+    // Keywords always own their text, so it can be lent out.
+    const String& value() const { return m_value; }
+
+    const malKeyword* interned() const { return m_interned; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malKeyword*>(rhs)->value();
+        return m_interned == static_cast<const malKeyword*>(rhs)->m_interned;
     }
 
     WITH_META(malKeyword);
+
+private:
+    const malKeyword* const m_interned;
 };
 
 class malSymbol : public malStringBase {
 public:
-    malSymbol(const String& token)
-        : malStringBase(token) { }
-    malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+    malSymbol(String token)
+        : malStringBase(MAL_SYMBOL, std::move(token)), m_interned(this)
+        , m_specialForm(0) { }
+    malSymbol(const malSymbol& that, const malValuePtr& meta)
+        : malStringBase(that, meta), m_interned(that.m_interned)
+        , m_specialForm(0) { }
+
+    TYPE_TAG(MAL_SYMBOL);
+
+    const String& value() const { return m_value; }
+
+    virtual malValuePtr eval(const malEnvPtr& env);
 
-    virtual malValuePtr eval(malEnvPtr env);
+    const malSymbol* interned() const { return m_interned; }
+
+    // The evaluator can number its special forms, so that it can switch
+    // on the symbol at the head of a list. Zero for ordinary symbols.
+    int specialForm() const { return m_interned->m_specialForm; }
+    void setSpecialForm(int id) const { m_interned->m_specialForm = id; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malSymbol*>(rhs)->value();
+        return m_interned == static_cast<const malSymbol*>(rhs)->m_interned;
     }
 
     WITH_META(malSymbol);
+
+private:
+    const malSymbol* const m_interned;
+    mutable int m_specialForm;
 };
 
 class malSequence : public malValue {
 public:
-    malSequence(malValueVec* items);
-    malSequence(malValueIter begin, malValueIter end);
-    malSequence(const malSequence& that, malValuePtr meta);
-    virtual ~malSequence();
+    malSequence(malType type, int count)
+        : malValue(type), m_count(count), m_hash(0) { }
+    malSequence(const malSequence& that, const malValuePtr& meta)
+        : malValue(that.type(), meta), m_count(that.m_count)
+        , m_hash(that.m_hash) { }
 
-    virtual String print(bool readably) const;
+    TYPE_RANGE(MAL_LIST, MAL_VECTOR);
 
-    malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
-
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    void evalItems(const malEnvPtr& env, malArgs& args) const;
+    void pushItems(malArgs& args, int start) const;
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    virtual const malValuePtr& item(int index) const = 0;
 
+    virtual uint32_t hash() const;
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
@@ -183,79 +386,144 @@ public:
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
-private:
-    malValueVec* const m_items;
+protected:
+    void printItems(malPrinter& out, char open, char close) const;
+
+    int m_count;
+    mutable uint32_t m_hash;    // 0 until it's been worked out
 };
 
+class malListBuffer; // Types.cpp
+
+// A list keeps its items in reverse order, at the start of a buffer which
+// is never reallocated. That makes rest a shorter view of the same buffer,
+// and lets cons append to the buffer in place, if it has room and nothing
+// else has appended there already.
 class malList : public malSequence {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
-    malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
-    malList(const malList& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+    malList(malValueVec* items);
+    malList(malValueIter begin, malValueIter end);
+    malList(const malList& that, const malValuePtr& meta);
+    virtual ~malList();
+
+    TYPE_TAG(MAL_LIST);
 
-    virtual String print(bool readably) const;
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual void printTo(malPrinter& out) const;
+    virtual malValuePtr eval(const malEnvPtr& env);
 
+    virtual const malValuePtr& item(int index) const {
+        return m_first[-index];
+    }
+
+    malValuePtr cons(const malValuePtr& item) const;
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
+    virtual malValuePtr rest() const;
+
+    // The evaluator can keep what it has worked out about a call site
+    // here, such as its macro expansion.
+    RefCounted* cache() const { return m_cache.ptr(); }
+    void setCache(RefCounted* cache) const { m_cache = cache; }
 
     WITH_META(malList);
+
+private:
+    malList(const RefCountedPtr<malListBuffer>& buffer, int count);
+
+    RefCountedPtr<malListBuffer> m_buffer;
+    const malValuePtr* m_first; // the last of m_count items in m_buffer
+    mutable RefCountedPtr<RefCounted> m_cache;
 };
 
+class malVectorLeaf; // Types.cpp
+
+// A persistent vector: a trie of 32-way nodes, with the items in the
+// leaves, so that conj, assoc and item are O(log32 N), and share all but
+// the path to the item they touch. The last 1-32 items are kept out of the
+// trie in the tail, so that conj usually only copies that.
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
-    malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
-    malVector(const malVector& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+    malVector(malValueIter begin, malValueIter end);
+    malVector(const malVector& that, const malValuePtr& meta);
+    virtual ~malVector();
 
-    virtual malValuePtr eval(malEnvPtr env);
-    virtual String print(bool readably) const;
+    TYPE_TAG(MAL_VECTOR);
+
+    virtual malValuePtr eval(const malEnvPtr& env);
+    virtual void printTo(malPrinter& out) const;
+
+    virtual const malValuePtr& item(int index) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
+    // Takes index/value pairs. An index of count() appends the value.
+    malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
+
     WITH_META(malVector);
+
+private:
+    malVector();
+
+    int tailOffset() const;
+    void push(const malValuePtr& value);
+    void set(int index, const malValuePtr& value);
+
+    RefCountedPtr<RefCounted> m_root;       // a leaf if m_shift is 0
+    int m_shift;                            // of the root's index bits
+    RefCountedPtr<malVectorLeaf> m_tail;
 };
 
 class malApplicable : public malValue {
 public:
-    malApplicable() { }
-    malApplicable(malValuePtr meta) : malValue(meta) { }
+    malApplicable(malType type) : malValue(type) { }
+    malApplicable(malType type, const malValuePtr& meta)
+        : malValue(type, meta) { }
+
+    TYPE_RANGE(MAL_BUILTIN, MAL_LAMBDA);
 
     virtual malValuePtr apply(malValueIter argsBegin,
                                malValueIter argsEnd) const = 0;
 };
 
+class malHashNode; // Types.cpp
+
+// A hash array mapped trie: each level takes five more bits of the key's
+// hash, and nodes are shared between maps, so that assoc and dissoc only
+// copy the path to the key they change.
 class malHash : public malValue {
 public:
-    typedef std::map<String, malValuePtr> Map;
-
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
-    malHash(const malHash::Map& map);
-    malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    malHash(const malHash& that, const malValuePtr& meta);
+    virtual ~malHash();
+
+    TYPE_TAG(MAL_HASH);
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
-    bool contains(malValuePtr key) const;
-    malValuePtr eval(malEnvPtr env);
-    malValuePtr get(malValuePtr key) const;
+    bool contains(const malValuePtr& key) const;
+    malValuePtr eval(const malEnvPtr& env);
+    bool isEvaluated() const { return m_isEvaluated; }
+    malValuePtr get(const malValuePtr& key) const;
     malValuePtr keys() const;
     malValuePtr values() const;
 
-    virtual String print(bool readably) const;
+    virtual void printTo(malPrinter& out) const;
 
+    virtual uint32_t hash() const;
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
     WITH_META(malHash);
 
 private:
-    const Map m_map;
-    const bool m_isEvaluated;
+    malHash();
+
+    void set(const malValuePtr& key, const malValuePtr& value);
+
+    RefCountedPtr<malHashNode> m_root;
+    int m_count;
+    bool m_isEvaluated;
+    mutable uint32_t m_hash;    // 0 until it's been worked out
 };
 
 class malBuiltIn : public malApplicable {
@@ -265,16 +533,19 @@ public:
                                     malValueIter argsEnd);
 
     malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    : malApplicable(MAL_BUILTIN), m_name(name), m_handler(handler) { }
 
-    malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    malBuiltIn(const malBuiltIn& that, const malValuePtr& meta)
+    : malApplicable(MAL_BUILTIN, meta), m_name(that.m_name)
+    , m_handler(that.m_handler) { }
+
+    TYPE_TAG(MAL_BUILTIN);
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
-    virtual String print(bool readably) const {
-        return STRF("#builtin-function(%s)", m_name.c_str());
+    virtual void printTo(malPrinter& out) const {
+        out.write(STRF("#builtin-function(%s)", m_name.c_str()));
     }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
@@ -293,9 +564,12 @@ private:
 class malLambda : public malApplicable {
 public:
     malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
-    malLambda(const malLambda& that, malValuePtr meta);
+    malLambda(const malScopePtr& scope, malValuePtr body, malEnvPtr env);
+    malLambda(const malLambda& that, const malValuePtr& meta);
     malLambda(const malLambda& that, bool isMacro);
 
+    TYPE_TAG(MAL_LAMBDA);
+
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
@@ -306,38 +580,69 @@ public:
         return this == rhs; // do we need to do a deep inspection?
     }
 
-    virtual String print(bool readably) const {
-        return STRF("#user-%s(%p)", m_isMacro ? "macro" : "function", this);
+    virtual void printTo(malPrinter& out) const {
+        out.write(STRF("#user-%s(%p)",
+                       m_isMacro ? "macro" : "function", this));
     }
 
     bool isMacro() const { return m_isMacro; }
 
-    virtual malValuePtr doWithMeta(malValuePtr meta) const;
+    virtual malValuePtr doWithMeta(const malValuePtr& meta) const;
 
 private:
     const StringVec   m_bindings;
+    const malScopePtr m_scope;
     const malValuePtr m_body;
     const malEnvPtr   m_env;
     const bool        m_isMacro;
 };
 
+// The names bound by a fn*, let* or catch*, each with a slot in the frames
+// made for it. It's built once when the form is analyzed, and shared by
+// all of those frames.
+class malScope : public RefCounted {
+public:
+    malScope() : m_isVariadic(false) { }
+
+    // Returns the slot for the name, adding one if needed. A def! inside
+    // the form can add names after frames have been made, so frames may be
+    // shorter than the scope.
+    int add(const malSymbol* symbol);
+    int find(const malSymbol* symbol) const; // -1 if not bound here
+    int size() const { return m_names.size(); }
+
+    // The slots of the fn* parameters or let* bindings, in order. For a
+    // variadic fn*, the last one takes the list of remaining arguments.
+    void bind(const malSymbol* symbol) { m_bindings.push_back(add(symbol)); }
+    const std::vector<int>& bindings() const { return m_bindings; }
+
+    bool isVariadic() const { return m_isVariadic; }
+    void setVariadic() { m_isVariadic = true; }
+
+private:
+    std::vector<const malSymbol*> m_names;
+    std::vector<int> m_bindings;
+    bool m_isVariadic;
+};
+
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
-    malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+    malAtom(malValuePtr value)
+        : malValue(MAL_ATOM), m_value(std::move(value)) { }
+    malAtom(const malAtom& that, const malValuePtr& meta)
+        : malValue(MAL_ATOM, meta), m_value(that.m_value) { }
+
+    TYPE_TAG(MAL_ATOM);
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this->m_value->isEqualTo(rhs);
     }
 
-    virtual String print(bool readably) const {
-        return "(atom " + m_value->print(readably) + ")";
-    };
+    virtual void printTo(malPrinter& out) const;
 
     malValuePtr deref() const { return m_value; }
 
-    malValuePtr reset(malValuePtr value) { return m_value = value; }
+    malValuePtr reset(const malValuePtr& value) { return m_value = value; }
 
     WITH_META(malAtom);
 
@@ -345,18 +650,89 @@ private:
     malValuePtr m_value;
 };
 
+// The arguments of the calls in progress, evaluated in place on one stack
+// rather than into a new vector for each call, and popped when the call
+// returns. Builtins are passed iterators into the stack, so its storage is
+// reserved up front, and it never grows beyond that.
+class malArgStack {
+public:
+    explicit malArgStack(size_t capacity) { m_items.reserve(capacity); }
+
+    size_t size() const { return m_items.size(); }
+    malValueIter begin() { return m_items.begin(); }
+    malValueIter end() { return m_items.end(); }
+    malValuePtr& back() { return m_items.back(); }
+
+    void push_back(const malValuePtr& value) {
+        if (m_items.size() == m_items.capacity()) {
+            overflow();
+        }
+        m_items.push_back(value);
+    }
+
+    void push_back(malValuePtr&& value) {
+        if (m_items.size() == m_items.capacity()) {
+            overflow();
+        }
+        m_items.push_back(std::move(value));
+    }
+
+    void pop_back() { m_items.pop_back(); }
+
+    // Only ever shrinks the stack.
+    void resize(size_t size) {
+        ASSERT(size <= m_items.size(), "Can't grow the stack to %zu\n", size);
+        m_items.erase(m_items.begin() + size, m_items.end());
+    }
+
+private:
+    static void overflow(); // throws
+
+    malValueVec m_items;
+};
+
+// The arguments of one call: those pushed while it's in scope are popped
+// when it goes, even if that's by an exception.
+class malArgs {
+public:
+    malArgs() : m_base(s_stack.size()) { }
+    ~malArgs() { s_stack.resize(m_base); }
+
+    void push(const malValuePtr& value) { s_stack.push_back(value); }
+    void push(malValuePtr&& value) { s_stack.push_back(std::move(value)); }
+
+    malValueIter begin() const { return s_stack.begin() + m_base; }
+    malValueIter end() const { return s_stack.end(); }
+    const malValuePtr& operator [] (size_t index) const {
+        return *(begin() + index);
+    }
+
+    static malArgStack& stack() { return s_stack; }
+
+private:
+    malArgs(const malArgs&) = delete;
+    malArgs& operator = (const malArgs&) = delete;
+
+    const size_t m_base;
+    static malArgStack s_stack;
+};
+
 namespace mal {
+    // These handle immediates without boxing them.
+    bool equal(const malValuePtr& lhs, const malValuePtr& rhs);
+    uint32_t hashOf(const malValuePtr& value);
+    String print(const malValuePtr& value, bool readably);
+
     malValuePtr atom(malValuePtr value);
     malValuePtr boolean(bool value);
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler);
     malValuePtr falseValue();
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
-    malValuePtr hash(const malHash::Map& map);
     malValuePtr integer(int64_t value);
-    malValuePtr integer(const String& token);
-    malValuePtr keyword(const String& token);
+    malValuePtr keyword(StringView token);
     malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const malScopePtr&, malValuePtr, malEnvPtr);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
@@ -364,8 +740,8 @@ namespace mal {
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
     malValuePtr macro(const malLambda& lambda);
     malValuePtr nilValue();
-    malValuePtr string(const String& token);
-    malValuePtr symbol(const String& token);
+    malValuePtr string(String token);
+    malValuePtr symbol(StringView token);
     malValuePtr trueValue();
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
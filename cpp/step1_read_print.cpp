@@ -7,7 +7,7 @@
 #include <memory>
 
 malValuePtr READ(const String& input);
-String PRINT(malValuePtr ast);
+String PRINT(const malValuePtr& ast);
 
 static ReadLine s_readLine("~/.mal-history");
 
@@ -49,7 +49,7 @@ static malValuePtr EVAL(malValuePtr ast)
     return ast;
 }
 
-String PRINT(malValuePtr ast)
+String PRINT(const malValuePtr& ast)
 {
     return ast->print(true);
 }
@@ -60,7 +60,8 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr)
     return ast;
 }
 
-malValuePtr APPLY(malValuePtr ast, malValueIter, malValueIter)
+malValuePtr APPLY(const malValuePtr& ast,
+                  malValueIter, malValueIter)
 {
     return ast;
 }
@@ -8,7 +8,7 @@
 #include <memory>
 
 malValuePtr READ(const String& input);
-String PRINT(malValuePtr ast);
+String PRINT(const malValuePtr& ast);
 
 static ReadLine s_readLine("~/.mal-history");
 static malBuiltIn::ApplyFunc
@@ -39,7 +39,7 @@ int main(int argc, char* argv[])
     return 0;
 }
 
-String rep(const String& input, malEnvPtr env)
+String rep(const String& input, const malEnvPtr& env)
 {
     return PRINT(EVAL(READ(input), env));
 }
@@ -54,12 +54,13 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     return ast->eval(env);
 }
 
-String PRINT(malValuePtr ast)
+String PRINT(const malValuePtr& ast)
 {
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -68,7 +69,7 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
     return handler->apply(argsBegin, argsEnd);
 }
 
-#define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define INT_ARG(name) int64_t name = INTEGER_CAST(*argsBegin++)
 
 #define CHECK_ARGS_IS(expected) \
     checkArgsIs(name.c_str(), expected, std::distance(argsBegin, argsEnd))
@@ -81,38 +82,38 @@ static malValuePtr builtIn_add(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() + rhs->value());
+        INT_ARG(lhs);
+        INT_ARG(rhs);
+        return mal::integer(lhs + rhs);
 }
 
 static malValuePtr builtIn_sub(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         int argCount = CHECK_ARGS_BETWEEN(1, 2);
-        ARG(malInteger, lhs);
+        INT_ARG(lhs);
         if (argCount == 1) {
-            return mal::integer(- lhs->value());
+            return mal::integer(- lhs);
         }
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() - rhs->value());
+        INT_ARG(rhs);
+        return mal::integer(lhs - rhs);
 }
 
 static malValuePtr builtIn_mul(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() * rhs->value());
+        INT_ARG(lhs);
+        INT_ARG(rhs);
+        return mal::integer(lhs * rhs);
 }
 
 static malValuePtr builtIn_div(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        MAL_CHECK(rhs->value() != 0, "Division by zero"); \
-        return mal::integer(lhs->value() / rhs->value());
+        INT_ARG(lhs);
+        INT_ARG(rhs);
+        MAL_CHECK(rhs != 0, "Division by zero"); \
+        return mal::integer(lhs / rhs);
 }
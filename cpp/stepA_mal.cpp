@@ -4,59 +4,145 @@
 #include "ReadLine.h"
 #include "Types.h"
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 
 malValuePtr READ(const String& input);
-String PRINT(malValuePtr ast);
-static void installFunctions(malEnvPtr env);
+void PRINT(const malValuePtr& ast, malPrinter& out);
+static void installFunctions(const malEnvPtr& env);
 
-static void makeArgv(malEnvPtr env, int argc, char* argv[]);
-static String safeRep(const String& input, malEnvPtr env);
-static malValuePtr quasiquote(malValuePtr obj);
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
-static void installMacros(malEnvPtr env);
+static void makeArgv(const malEnvPtr& env, int argc, char* argv[]);
+static void safeRep(const String& input, const malEnvPtr& env,
+                    malPrinter& out);
+static malValuePtr quasiquote(const malValuePtr& obj);
+static malValuePtr macroExpand(malValuePtr obj, const malEnvPtr& env);
+static malValuePtr analyze(const malValuePtr& ast, const malEnvPtr& env);
+static malValuePtr run(const malValuePtr& node, const malEnvPtr& env);
+static void installDisassembler(const malEnvPtr& env);
+static void installMacros(const malEnvPtr& env);
+static void installSpecialForms();
 
 static ReadLine s_readLine("~/.mal-history");
 
+static const malValuePtr s_ampersand(mal::symbol("&"));
+static const malValuePtr s_concat(mal::symbol("concat"));
+static const malValuePtr s_cons(mal::symbol("cons"));
+static const malValuePtr s_quote(mal::symbol("quote"));
+static const malValuePtr s_spliceUnquote(mal::symbol("splice-unquote"));
+static const malValuePtr s_unquote(mal::symbol("unquote"));
+
+enum SpecialForm {
+    SF_NONE = 0,
+    SF_CATCH,
+    SF_DEF,
+    SF_DEFMACRO,
+    SF_DO,
+    SF_FN,
+    SF_IF,
+    SF_LET,
+    SF_MACROEXPAND,
+    SF_QUASIQUOTE,
+    SF_QUOTE,
+    SF_TRY,
+};
+
+// Analysis turns a form into a tree of nodes, each of which evaluates one
+// kind of form, with what can be known before it's run already worked out:
+// which special form it is, and where each name is bound. Macro calls are
+// expanded when they're first reached, so that expanding them happens
+// inside any try* around them, and only on the branches that are taken.
+class Compiler;
+
+class malNode : public malValue {
+public:
+    malNode() : malValue(MAL_NODE) { }
+
+    TYPE_TAG(MAL_NODE);
+
+    // Returns the node's value, or NULL having set next to a node to be
+    // evaluated in its place, in nextEnv if that's set, or else in env.
+    // That lets run() make tail calls in a loop.
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const = 0;
+
+    // Appends the node's bytecode, which ends by returning from the
+    // function if the node is in tail position.
+    virtual void compile(Compiler& compiler, bool isTail) const = 0;
+
+    // Appends the bytecode for the node as the operator of CallNode call,
+    // which checks that it isn't a macro. Returns the label for the code
+    // after the call.
+    virtual int compileOperator(Compiler& compiler, int call,
+                                bool isTail) const;
+
+    // The node compiled for the VM, made the first time it's needed.
+    const malValuePtr& bytecode() const;
+
+    virtual void printTo(malPrinter& out) const {
+        out.write(STRF("#node(%p)", this));
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    // Nodes are only ever seen by the evaluator.
+    virtual malValuePtr doWithMeta(const malValuePtr& meta) const {
+        return malValuePtr(const_cast<malNode*>(this));
+    }
+
+private:
+    mutable malValuePtr m_bytecode;
+};
+
 static malEnvPtr replEnv(new malEnv);
+static bool s_useVM = false; // see VM below
 
 int main(int argc, char* argv[])
 {
     String prompt = "user> ";
     String input;
+    installSpecialForms();
+    if (const char* engine = getenv("MAL_ENGINE")) {
+        s_useVM = (String(engine) == "vm");
+    }
     installCore(replEnv);
+    installDisassembler(replEnv);
     installFunctions(replEnv);
     installMacros(replEnv);
     makeArgv(replEnv, argc - 2, argv + 2);
     if (argc > 1) {
         String filename = escape(argv[1]);
-        safeRep(STRF("(load-file %s)", filename.c_str()), replEnv);
+        malPrinter ignored(true);
+        safeRep(STRF("(load-file %s)", filename.c_str()), replEnv, ignored);
         return 0;
     }
     rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
     while (s_readLine.get(prompt, input)) {
-        String out = safeRep(input, replEnv);
-        if (out.length() > 0)
-            std::cout << out << "\n";
+        malPrinter out(std::cout, true);
+        safeRep(input, replEnv, out);
     }
     return 0;
 }
 
-static String safeRep(const String& input, malEnvPtr env)
+// Prints the result, or the error, to out.
+static void safeRep(const String& input, const malEnvPtr& env,
+                    malPrinter& out)
 {
     try {
-        return rep(input, env);
+        PRINT(EVAL(READ(input), env), out);
+        out.write('\n');
     }
     catch (malEmptyInputException&) {
-        return String();
     }
     catch (String& s) {
-        return s;
+        out.write(s);
+        out.write('\n');
     };
 }
 
-static void makeArgv(malEnvPtr env, int argc, char* argv[])
+static void makeArgv(const malEnvPtr& env, int argc, char* argv[])
 {
     malValueVec* args = new malValueVec();
     for (int i = 0; i < argc; i++) {
@@ -65,9 +151,11 @@ static void makeArgv(malEnvPtr env, int argc, char* argv[])
     env->set("*ARGV*", mal::list(args));
 }
 
-String rep(const String& input, malEnvPtr env)
+String rep(const String& input, const malEnvPtr& env)
 {
-    return PRINT(EVAL(READ(input), env));
+    malPrinter out(true);
+    PRINT(EVAL(READ(input), env), out);
+    return std::move(out.str());
 }
 
 malValuePtr READ(const String& input)
@@ -75,250 +163,1566 @@ malValuePtr READ(const String& input)
     return readStr(input);
 }
 
+// Evaluation is in two parts. analyze() works out all it can about a form
+// before it's run, and turns it into a tree of nodes, which run() evaluates.
+// A fn* is analyzed along with the form it's in, so however often it's
+// called, its body is only analyzed once.
 malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 {
+    if (ast.isImmediate()) {
+        return ast;
+    }
     if (!env) {
         env = replEnv;
     }
-    while (1) {
-        const malList* list = DYNAMIC_CAST(malList, ast);
-        if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+    if (!isa<malNode>(ast.ptr())) {
+        ast = analyze(ast, env);
+    }
+    if (s_useVM) {
+        return run(STATIC_CAST(malNode, ast)->bytecode(), env);
+    }
+    return run(ast, env);
+}
+
+void PRINT(const malValuePtr& ast, malPrinter& out)
+{
+    out.print(ast);
+}
+
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
+{
+    const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
+    MAL_CHECK(handler != NULL,
+              "\"%s\" is not applicable", op->print(true).c_str());
+
+    return handler->apply(argsBegin, argsEnd);
+}
+
+static bool isSymbol(const malValuePtr& obj, const malValuePtr& interned)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
+    return sym && (sym->interned() == interned.ptr());
+}
+
+static const malSequence* isPair(const malValuePtr& obj)
+{
+    const malSequence* list = DYNAMIC_CAST(malSequence, obj);
+    return list && !list->isEmpty() ? list : NULL;
+}
+
+static malValuePtr quasiquote(const malValuePtr& obj)
+{
+    const malSequence* seq = isPair(obj);
+    if (!seq) {
+        return mal::list(s_quote, obj);
+    }
+
+    if (isSymbol(seq->item(0), s_unquote)) {
+        // (qq (uq form)) -> form
+        checkArgsIs("unquote", 1, seq->count() - 1);
+        return seq->item(1);
+    }
+
+    const malSequence* innerSeq = isPair(seq->item(0));
+    if (innerSeq && isSymbol(innerSeq->item(0), s_spliceUnquote)) {
+        checkArgsIs("splice-unquote", 1, innerSeq->count() - 1);
+        // (qq (sq '(a b c))) -> a b c
+        return mal::list(
+            s_concat,
+            innerSeq->item(1),
+            quasiquote(seq->rest())
+        );
+    }
+    else {
+        // (qq (a b c)) -> (list (qq a) (qq b) (qq c))
+        // (qq xs     ) -> (cons (qq (car xs)) (qq (cdr xs)))
+        return mal::list(
+            s_cons,
+            quasiquote(seq->first()),
+            quasiquote(seq->rest())
+        );
+    }
+}
+
+static const malLambda* isMacroApplication(const malValuePtr& obj,
+                                           const malEnvPtr& env)
+{
+    if (const malSequence* seq = isPair(obj)) {
+        if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(0))) {
+            const malLambda* lambda =
+                DYNAMIC_CAST(malLambda, env->lookup(sym->interned()));
+            return lambda && lambda->isMacro() ? lambda : NULL;
         }
+    }
+    return NULL;
+}
+
+static malValuePtr macroExpand(malValuePtr obj, const malEnvPtr& env)
+{
+    while (const malLambda* macro = isMacroApplication(obj, env)) {
+        malArgs args;
+        STATIC_CAST(malSequence, obj)->pushItems(args, 1);
+        obj = macro->apply(args.begin(), args.end());
+    }
+    return obj;
+}
+
+static malValuePtr run(const malValuePtr& node, const malEnvPtr& env)
+{
+    // The first step is made on the caller's references, so that a node
+    // which produces its value straight away costs no copies.
+    malValuePtr next;
+    malEnvPtr nextEnv;
+    malValuePtr value = STATIC_CAST(malNode, node)->step(env, next, nextEnv);
+    if (value) {
+        return value;
+    }
 
-        ast = macroExpand(ast, env);
-        list = DYNAMIC_CAST(malList, ast);
-        if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+    malValuePtr current;
+    malEnvPtr currentEnv = nextEnv ? std::move(nextEnv) : env;
+    do {
+        current = std::move(next);
+        value = STATIC_CAST(malNode, current)->step(currentEnv,
+                                                     next, nextEnv);
+        if (nextEnv) {
+            currentEnv = std::move(nextEnv);
         }
+    } while (!value);
+    return value;
+}
 
-        // From here on down we are evaluating a non-empty list.
-        // First handle the special forms.
-        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
-            int argCount = list->count() - 1;
+static malValuePtr expand(const malList* site, const malLambda* macro,
+                          const malEnvPtr& env);
 
-            if (special == "def!") {
-                checkArgsIs("def!", 2, argCount);
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
-            }
+class ConstNode : public malNode {
+public:
+    ConstNode(const malValuePtr& value) : m_value(value) { }
 
-            if (special == "defmacro!") {
-                checkArgsIs("defmacro!", 2, argCount);
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        return m_value;
+    }
 
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                malValuePtr body = EVAL(list->item(2), env);
-                const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
-            }
+    virtual void compile(Compiler& compiler, bool isTail) const;
 
-            if (special == "do") {
-                checkArgsAtLeast("do", 1, argCount);
+private:
+    const malValuePtr m_value;
+};
 
-                for (int i = 1; i < argCount; i++) {
-                    EVAL(list->item(i), env);
-                }
-                ast = list->item(argCount);
-                continue; // TCO
-            }
+// A reference to a fn*, let* or catch* binding, by the depth of its frame
+// from the current one and its slot in that frame.
+class LocalRefNode : public malNode {
+public:
+    LocalRefNode(int depth, int slot, const malSymbol* symbol)
+        : m_depth(depth), m_slot(slot), m_symbol(symbol) { }
 
-            if (special == "fn*") {
-                checkArgsIs("fn*", 2, argCount);
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        return env->get(m_depth, m_slot, m_symbol);
+    }
 
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
-                }
+    virtual void compile(Compiler& compiler, bool isTail) const;
 
-                return mal::lambda(params, list->item(2), env);
-            }
+private:
+    const int m_depth;
+    const int m_slot;
+    const malSymbol* const m_symbol; // interned, so immortal
+};
 
-            if (special == "if") {
-                checkArgsBetween("if", 2, 3, argCount);
+// A reference to a global binding, by its cell in the global environment,
+// so that it's a single load which still sees a later def!. The cell is
+// created unbound if the name hasn't been defined yet.
+class GlobalRefNode : public malNode {
+public:
+    GlobalRefNode(const malEnvPtr& globals, const malSymbol* symbol)
+        : m_globals(globals), m_cell(globals->cell(symbol))
+        , m_symbol(symbol) { }
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
-                if (!isTrue && (argCount == 2)) {
-                    return mal::nilValue();
-                }
-                ast = list->item(isTrue ? 2 : 3);
-                continue; // TCO
-            }
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        return get();
+    }
 
-            if (special == "let*") {
-                checkArgsIs("let*", 2, argCount);
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
-                for (int i = 0; i < count; i += 2) {
-                    const malSymbol* var =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
-                }
-                ast = list->item(2);
-                env = inner;
-                continue; // TCO
-            }
+    const malValuePtr& get() const {
+        MAL_CHECK(*m_cell, "'%s' not found", m_symbol->value().c_str());
+        return *m_cell;
+    }
+
+    const malValuePtr& value() const { return *m_cell; } // NULL if unbound
+    const malSymbol* symbol() const { return m_symbol; }
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+    virtual int compileOperator(Compiler& compiler, int call,
+                                bool isTail) const;
+
+private:
+    const malEnvPtr m_globals; // keeps the cell alive
+    const malValuePtr* const m_cell;
+    const malSymbol* const m_symbol;
+};
+
+class VectorNode : public malNode {
+public:
+    VectorNode(malValueVec items) : m_items(std::move(items)) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        malValueVec* items = new malValueVec;
+        items->reserve(m_items.size());
+        for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+            items->push_back(run(*it, env));
+        }
+        return mal::vector(items);
+    }
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+
+private:
+    const malValueVec m_items;
+};
+
+// The keys and values of a hash map literal, in turn.
+class HashNode : public malNode {
+public:
+    HashNode(malValueVec items) : m_items(std::move(items)) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        malValueVec items;
+        items.reserve(m_items.size());
+        for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+            items.push_back(run(*it, env));
+        }
+        return mal::hash(items.begin(), items.end(), true);
+    }
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+
+private:
+    const malValueVec m_items;
+};
+
+class IfNode : public malNode {
+public:
+    IfNode(const malValuePtr& test, const malValuePtr& then,
+           const malValuePtr& otherwise) // NULL if there's no else
+        : m_test(test), m_then(then), m_else(otherwise) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        bool isTrue = isTruthy(run(m_test, env));
+        if (!isTrue && !m_else) {
+            return mal::nilValue();
+        }
+        next = isTrue ? m_then : m_else;
+        return NULL; // TCO
+    }
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
 
-            if (special == "macroexpand") {
+private:
+    const malValuePtr m_test;
+    const malValuePtr m_then;
+    const malValuePtr m_else;
+};
+
+class DoNode : public malNode {
+public:
+    DoNode(malValueVec items) : m_items(std::move(items)) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        for (auto it = m_items.begin(), end = m_items.end() - 1;
+             it != end; ++it) {
+            run(*it, env);
+        }
+        next = m_items.back();
+        return NULL; // TCO
+    }
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+
+private:
+    const malValueVec m_items;
+};
+
+// Each value is evaluated in the new frame, as the body is.
+class LetNode : public malNode {
+public:
+    LetNode(const malScopePtr& scope, malValueVec values,
+            const malValuePtr& body)
+        : m_scope(scope), m_values(std::move(values)), m_body(body) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        const std::vector<int>& slots = m_scope->bindings();
+        malEnvPtr inner(new malEnv(env, m_scope));
+        for (int i = 0, n = slots.size(); i < n; i++) {
+            inner->setSlot(slots[i], run(m_values[i], inner));
+        }
+        next = m_body;
+        nextEnv = std::move(inner);
+        return NULL; // TCO
+    }
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+
+    const malScopePtr& scope() const { return m_scope; }
+
+private:
+    const malScopePtr m_scope;
+    const malValueVec m_values;
+    const malValuePtr m_body;
+};
+
+class FnNode : public malNode {
+public:
+    FnNode(const malScopePtr& scope, const malValuePtr& body)
+        : m_scope(scope), m_body(body) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        return makeLambda(env);
+    }
+
+    malValuePtr makeLambda(const malEnvPtr& env) const {
+        return mal::lambda(m_scope, m_body, env);
+    }
+
+    const malValuePtr& body() const { return m_body; }
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+
+private:
+    const malScopePtr m_scope;
+    const malValuePtr m_body;
+};
+
+// A def! or defmacro!, of a slot in the current frame if it's inside a
+// fn*, let* or catch*, or else of a global.
+class DefNode : public malNode {
+public:
+    DefNode(const malSymbol* symbol, int slot, const malValuePtr& value,
+            bool isMacro)
+        : m_symbol(symbol), m_slot(slot), m_value(value)
+        , m_isMacro(isMacro) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        malValuePtr value = run(m_value, env);
+        if (m_isMacro) {
+            value = mal::macro(*VALUE_CAST(malLambda, value));
+        }
+        return (m_slot >= 0) ? env->setSlot(m_slot, value)
+                             : env->set(m_symbol, value);
+    }
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+
+private:
+    const malSymbol* const m_symbol;
+    const int m_slot; // -1 for a global
+    const malValuePtr m_value;
+    const bool m_isMacro;
+};
+
+class TryNode : public malNode {
+public:
+    TryNode(const malValuePtr& body, const malScopePtr& scope,
+            const malValuePtr& handler)
+        : m_body(body), m_scope(scope), m_handler(handler) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        malValuePtr excVal;
+
+        try {
+            return run(m_body, env);
+        }
+        catch(String& s) {
+            excVal = mal::string(s);
+        }
+        catch (malEmptyInputException&) {
+            // Not an error, continue as if we got nil
+            return mal::nilValue();
+        }
+        catch(malValuePtr& o) {
+            excVal = o;
+        };
+
+        // we got some exception
+        nextEnv = new malEnv(env, m_scope);
+        nextEnv->setSlot(m_scope->bindings()[0], excVal);
+        next = m_handler;
+        return NULL; // TCO
+    }
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+
+    const malScopePtr& scope() const { return m_scope; }
+
+private:
+    const malValuePtr m_body;
+    const malScopePtr m_scope;
+    const malValuePtr m_handler;
+};
+
+// macroexpand returns the unanalyzed expansion.
+class MacroExpandNode : public malNode {
+public:
+    MacroExpandNode(const malValuePtr& form) : m_form(form) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const {
+        return macroExpand(m_form, env);
+    }
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+
+private:
+    const malValuePtr m_form;
+};
+
+// A function call. The operator may turn out to be a macro, if it was
+// defined after the call was analyzed, in which case the call is expanded
+// instead, as it's reached.
+class CallNode : public malNode {
+public:
+    CallNode(const malValuePtr& form, malValueVec items)
+        : m_form(form), m_items(std::move(items)) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const;
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+
+    const malList* site() const { return STATIC_CAST(malList, m_form); }
+
+private:
+    const malValuePtr m_form;
+    const malValueVec m_items; // the operator, then the arguments
+};
+
+malValuePtr CallNode::step(const malEnvPtr& env, malValuePtr& next,
+                           malEnvPtr& nextEnv) const
+{
+    malValuePtr op = run(m_items[0], env);
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    if (lambda && lambda->isMacro()) {
+        next = expand(site(), lambda, env);
+        return NULL;
+    }
+
+    malArgs args;
+    for (auto it = m_items.begin() + 1, end = m_items.end(); it != end; ++it) {
+        args.push(run(*it, env));
+    }
+    if (lambda) {
+        nextEnv = lambda->makeEnv(args.begin(), args.end());
+        next = lambda->getBody();
+        return NULL; // TCO
+    }
+    return APPLY(op, args.begin(), args.end());
+}
+
+// A call of a global macro, expanded the first time it's reached. The
+// expansion is only used while the name still refers to that macro; if
+// it's been redefined, the call is expanded again, or analyzed as a
+// function call.
+class MacroNode : public malNode {
+public:
+    MacroNode(const malValuePtr& form, const malValuePtr& head)
+        : m_form(form), m_head(head) { }
+
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const;
+
+    virtual void compile(Compiler& compiler, bool isTail) const;
+
+    // The node for the form as it expands now.
+    const malValuePtr& expansion(const malEnvPtr& env) const;
+
+private:
+    const malValuePtr m_form;
+    const malValuePtr m_head;
+    mutable malValuePtr m_headValue; // what m_node was made for, if set
+    mutable malValuePtr m_node;
+};
+
+#if DEBUG_MACROEXPAND_STATS
+    static unsigned long s_expansions = 0;
+    static unsigned long s_cachedExpansions = 0;
+
+    static void reportExpansions()
+    {
+        TRACE("macroexpand: %lu expansions, %lu (%.1f%%) from the cache\n",
+              s_expansions, s_cachedExpansions,
+              s_expansions ? 100.0 * s_cachedExpansions / s_expansions : 0);
+    }
+
+    static const int s_reportAtExit = atexit(reportExpansions);
+
+    #define COUNT_EXPANSION(isCached) \
+        do { s_expansions++; s_cachedExpansions += (isCached); } while (false)
+#else
+    #define COUNT_EXPANSION(isCached)  NOOP
+#endif
+
+// A call site's expansion, analyzed in the scope it was expanded in.
+// Holding the macro means that its address can't be reused, so a def! of
+// the macro's name always misses.
+class MacroExpansion : public RefCounted {
+public:
+    MacroExpansion(const malLambda* macro, const malScopePtr& scope,
+                   const malValuePtr& expansion)
+        : m_macro(const_cast<malLambda*>(macro)), m_scope(scope)
+        , m_expansion(expansion) { }
+
+    bool matches(const malLambda* macro, const malScope* scope) const {
+        return (m_macro.ptr() == macro) && (m_scope.ptr() == scope);
+    }
+
+    const malValuePtr& expansion() const { return m_expansion; }
+
+private:
+    const malValuePtr m_macro;
+    const malScopePtr m_scope;
+    const malValuePtr m_expansion;
+};
+
+// Macros are expanded once per call site, so analyzing the same form again,
+// as eval may, reuses its expansions.
+static malValuePtr cachedExpansion(const malList* site,
+                                   const malLambda* macro,
+                                   const malScope* scope)
+{
+    const MacroExpansion* cached =
+        static_cast<const MacroExpansion*>(site->cache());
+    if (cached && cached->matches(macro, scope)) {
+        COUNT_EXPANSION(true);
+        return cached->expansion();
+    }
+    return NULL;
+}
+
+// Analysis needs to know which names are bound in the frames that the form
+// will be run in, which are those it's nested in within the form, and the
+// frames of the environment it's being analyzed for. Any other name is
+// global. The binding forms each get a malScope, which lays out the frames
+// made for them.
+class Analyzer {
+public:
+    Analyzer(const malEnvPtr& env);
+
+    malValuePtr analyze(const malValuePtr& ast);
+    malValuePtr analyzeCall(const malValuePtr& ast);
+    malValuePtr expand(const malList* site, const malLambda* macro);
+
+private:
+    malValuePtr analyzeDef(const malList* list);
+    malValuePtr analyzeFn(const malList* list);
+    malValuePtr analyzeHash(const malHash* hash);
+    malValuePtr analyzeIf(const malList* list);
+    malValuePtr analyzeIn(malScope* scope, const malValuePtr& ast);
+    malValuePtr analyzeLet(const malList* list);
+    malValuePtr analyzeSymbol(const malSymbol* sym);
+    malValuePtr analyzeTry(const malList* list);
+    malValueVec analyzeItems(const malSequence* seq, int start);
+
+    const malLambda* isMacro(const malSymbol* sym) const;
+
+    std::vector<malScope*> m_scopes; // innermost last
+    malEnvPtr m_globals;
+};
+
+static malValuePtr analyze(const malValuePtr& ast, const malEnvPtr& env)
+{
+    return Analyzer(env).analyze(ast);
+}
+
+static malValuePtr expand(const malList* site, const malLambda* macro,
+                          const malEnvPtr& env)
+{
+    malValuePtr expansion = cachedExpansion(site, macro, env->scope().ptr());
+    return expansion ? expansion : Analyzer(env).expand(site, macro);
+}
+
+Analyzer::Analyzer(const malEnvPtr& env)
+{
+    // The scopes of the frames we're in are the enclosing scopes.
+    malEnv* frame = env.ptr();
+    for ( ; frame->scope(); frame = frame->outer().ptr()) {
+        m_scopes.push_back(frame->scope().ptr());
+    }
+    std::reverse(m_scopes.begin(), m_scopes.end());
+    m_globals = frame;
+}
+
+malValuePtr Analyzer::analyze(const malValuePtr& ast)
+{
+    if (ast.isImmediate()) {
+        return new ConstNode(ast);
+    }
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, ast)) {
+        return analyzeSymbol(sym);
+    }
+    if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        return new VectorNode(analyzeItems(vec, 0));
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        // Maps that have been evaluated already evaluate to themselves.
+        if (hash->isEvaluated()) {
+            return new ConstNode(ast);
+        }
+        return analyzeHash(hash);
+    }
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        return new ConstNode(ast);
+    }
+
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        int argCount = list->count() - 1;
+        switch (sym->specialForm()) {
+            case SF_DEF:
+            case SF_DEFMACRO:
+                return analyzeDef(list);
+
+            case SF_DO:
+                checkArgsAtLeast("do", 1, argCount);
+                return new DoNode(analyzeItems(list, 1));
+
+            case SF_FN:
+                return analyzeFn(list);
+
+            case SF_IF:
+                return analyzeIf(list);
+
+            case SF_LET:
+                return analyzeLet(list);
+
+            case SF_MACROEXPAND:
                 checkArgsIs("macroexpand", 1, argCount);
-                return macroExpand(list->item(1), env);
-            }
+                return new MacroExpandNode(list->item(1));
 
-            if (special == "quasiquote") {
+            case SF_QUASIQUOTE:
                 checkArgsIs("quasiquote", 1, argCount);
-                ast = quasiquote(list->item(1));
-                continue; // TCO
-            }
+                return analyze(quasiquote(list->item(1)));
 
-            if (special == "quote") {
+            case SF_QUOTE:
                 checkArgsIs("quote", 1, argCount);
-                return list->item(1);
-            }
+                return new ConstNode(list->item(1));
 
-            if (special == "try*") {
-                checkArgsIs("try*", 2, argCount);
-                malValuePtr tryBody = list->item(1);
-                const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+            case SF_TRY:
+                return analyzeTry(list);
 
-                checkArgsIs("catch*", 2, catchBlock->count() - 1);
-                MAL_CHECK(VALUE_CAST(malSymbol,
-                    catchBlock->item(0))->value() == "catch*",
-                    "catch block must begin with catch*");
+            case SF_NONE:
+                if (isMacro(sym)) {
+                    return new MacroNode(ast, analyzeSymbol(sym));
+                }
+                break;
 
-                // We don't need excSym at this scope, but we want to check
-                // that the catch block is valid always, not just in case of
-                // an exception.
-                const malSymbol* excSym =
-                    VALUE_CAST(malSymbol, catchBlock->item(1));
+            default: // catch* is only special inside a try*
+                break;
+        }
+    }
+    return analyzeCall(ast);
+}
 
-                malValuePtr excVal;
+malValuePtr Analyzer::analyzeCall(const malValuePtr& ast)
+{
+    return new CallNode(ast, analyzeItems(STATIC_CAST(malList, ast), 0));
+}
 
-                try {
-                    ast = EVAL(tryBody, env);
-                }
-                catch(String& s) {
-                    excVal = mal::string(s);
-                }
-                catch (malEmptyInputException&) {
-                    // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
-                }
-                catch(malValuePtr& o) {
-                    excVal = o;
-                };
+malValuePtr Analyzer::analyzeDef(const malList* list)
+{
+    const malSymbol* form = STATIC_CAST(malSymbol, list->item(0));
+    checkArgsIs(form->value().c_str(), 2, list->count() - 1);
+    const malSymbol* id = VALUE_CAST(malSymbol, list->item(1))->interned();
+    int slot = m_scopes.empty() ? -1 : m_scopes.back()->add(id);
+    return new DefNode(id, slot, analyze(list->item(2)),
+                       form->specialForm() == SF_DEFMACRO);
+}
 
-                if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
-                    ast = catchBlock->item(2);
-                }
-                continue; // TCO
-            }
+malValuePtr Analyzer::analyzeFn(const malList* list)
+{
+    checkArgsIs("fn*", 2, list->count() - 1);
+    const malSequence* params = VALUE_CAST(malSequence, list->item(1));
+    malScopePtr scope(new malScope);
+    for (int i = 0, count = params->count(); i < count; i++) {
+        const malSymbol* param =
+            VALUE_CAST(malSymbol, params->item(i))->interned();
+        if (isSymbol(params->item(i), s_ampersand)) {
+            MAL_CHECK(i == count - 2,
+                      "There must be one parameter after the &");
+            scope->setVariadic();
+            continue;
         }
+        scope->bind(param);
+    }
+    return new FnNode(scope, analyzeIn(scope.ptr(), list->item(2)));
+}
+
+malValuePtr Analyzer::analyzeIf(const malList* list)
+{
+    int argCount = checkArgsBetween("if", 2, 3, list->count() - 1);
+    malValuePtr test = analyze(list->item(1));
+    malValuePtr then = analyze(list->item(2));
+    malValuePtr otherwise;
+    if (argCount == 3) {
+        otherwise = analyze(list->item(3));
+    }
+    return new IfNode(test, then, otherwise);
+}
+
+malValuePtr Analyzer::analyzeIn(malScope* scope, const malValuePtr& ast)
+{
+    m_scopes.push_back(scope);
+    malValuePtr result = analyze(ast);
+    m_scopes.pop_back();
+    return result;
+}
 
-        // Now we're left with the case of a regular list to be evaluated.
-        std::unique_ptr<malValueVec> items(list->evalItems(env));
-        malValuePtr op = items->at(0);
-        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
-            ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
-            continue; // TCO
+malValuePtr Analyzer::analyzeLet(const malList* list)
+{
+    checkArgsIs("let*", 2, list->count() - 1);
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    int count = checkArgsEven("let*", bindings->count());
+    malScopePtr scope(new malScope);
+    for (int i = 0; i < count; i += 2) {
+        scope->bind(VALUE_CAST(malSymbol, bindings->item(i))->interned());
+    }
+
+    malValueVec values;
+    values.reserve(count / 2);
+    m_scopes.push_back(scope.ptr());
+    for (int i = 1; i < count; i += 2) {
+        values.push_back(analyze(bindings->item(i)));
+    }
+    malValuePtr body = analyze(list->item(2));
+    m_scopes.pop_back();
+
+    return new LetNode(scope, std::move(values), body);
+}
+
+malValuePtr Analyzer::analyzeSymbol(const malSymbol* sym)
+{
+    const malSymbol* name = sym->interned();
+    int depth = 0;
+    for (auto it = m_scopes.rbegin(); it != m_scopes.rend(); ++it, ++depth) {
+        int slot = (*it)->find(name);
+        if (slot >= 0) {
+            return new LocalRefNode(depth, slot, name);
         }
-        else {
-            return APPLY(op, items->begin()+1, items->end());
+    }
+    return new GlobalRefNode(m_globals, name);
+}
+
+malValuePtr Analyzer::analyzeTry(const malList* list)
+{
+    checkArgsIs("try*", 2, list->count() - 1);
+    const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+    MAL_CHECK(VALUE_CAST(malSymbol,
+        catchBlock->item(0))->specialForm() == SF_CATCH,
+        "catch block must begin with catch*");
+
+    malScopePtr scope(new malScope);
+    scope->bind(VALUE_CAST(malSymbol, catchBlock->item(1))->interned());
+
+    malValuePtr body = analyze(list->item(1));
+    malValuePtr handler = analyzeIn(scope.ptr(), catchBlock->item(2));
+    return new TryNode(body, scope, handler);
+}
+
+malValueVec Analyzer::analyzeItems(const malSequence* seq, int start)
+{
+    malValueVec items;
+    items.reserve(seq->count() - start);
+    for (int i = start, n = seq->count(); i < n; i++) {
+        items.push_back(analyze(seq->item(i)));
+    }
+    return items;
+}
+
+malValuePtr Analyzer::analyzeHash(const malHash* hash)
+{
+    // Both come out in the order of the map's entries.
+    malValuePtr keys = hash->keys();
+    malValuePtr values = hash->values();
+    const malList* keyList = STATIC_CAST(malList, keys);
+    const malList* valueList = STATIC_CAST(malList, values);
+    malValueVec items;
+    items.reserve(2 * keyList->count());
+    for (int i = 0, n = keyList->count(); i < n; i++) {
+        items.push_back(analyze(keyList->item(i)));
+        items.push_back(analyze(valueList->item(i)));
+    }
+    return new HashNode(std::move(items));
+}
+
+malValuePtr Analyzer::expand(const malList* site, const malLambda* macro)
+{
+    malScope* scope = m_scopes.empty() ? NULL : m_scopes.back();
+    malValuePtr expansion = cachedExpansion(site, macro, scope);
+    if (!expansion) {
+        COUNT_EXPANSION(false);
+        malArgs args;
+        site->pushItems(args, 1);
+        expansion = analyze(macro->apply(args.begin(), args.end()));
+        site->setCache(new MacroExpansion(macro, scope, expansion));
+    }
+    return expansion;
+}
+
+const malLambda* Analyzer::isMacro(const malSymbol* sym) const
+{
+    // A local binding hides any global macro of the same name.
+    const malSymbol* name = sym->interned();
+    for (auto it = m_scopes.begin(); it != m_scopes.end(); ++it) {
+        if ((*it)->find(name) >= 0) {
+            return NULL;
         }
     }
+    const malLambda* lambda =
+        DYNAMIC_CAST(malLambda, m_globals->lookup(name));
+    return lambda && lambda->isMacro() ? lambda : NULL;
 }
 
-String PRINT(malValuePtr ast)
+malValuePtr MacroNode::step(const malEnvPtr& env, malValuePtr& next,
+                            malEnvPtr& nextEnv) const
 {
-    return ast->print(true);
+    next = expansion(env);
+    return NULL;
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+const malValuePtr& MacroNode::expansion(const malEnvPtr& env) const
 {
-    const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
-    MAL_CHECK(handler != NULL,
-              "\"%s\" is not applicable", op->print(true).c_str());
+    const malValuePtr& value = STATIC_CAST(GlobalRefNode, m_head)->value();
+    if (value != m_headValue) {
+        const malLambda* macro = DYNAMIC_CAST(malLambda, value);
+        m_node = macro && macro->isMacro()
+            ? expand(STATIC_CAST(malList, m_form), macro, env)
+            : Analyzer(env).analyzeCall(m_form);
+        m_headValue = value;
+    }
+    return m_node;
+}
 
-    return handler->apply(argsBegin, argsEnd);
+// The bytecode VM is an alternative to run(), chosen at startup by setting
+// MAL_ENGINE=vm. It runs the same analyzed nodes, compiled to a flat array
+// of instructions for a stack machine: each instruction is an opcode and
+// its operands, and leaves its result on the operand stack. Calls to mal
+// functions, and the expansions of macros, push a frame rather than
+// recursing, so only builtins which call back into mal, such as map, make
+// the VM recurse.
+
+enum OpCode {
+    OP_CONST,           // k: push constant k
+    OP_LOCAL,           // depth slot k: push a local, whose symbol is k
+    OP_GLOBAL,          // k: push the global whose GlobalRefNode is k
+    OP_POP,
+    OP_JUMP,            // to
+    OP_JUMP_IF_FALSE,   // to: pops the test
+    OP_VECTOR,          // n: replace the top n values with a vector
+    OP_HASH,            // n: replace the top n keys and values with a map
+    OP_FN,              // k: push a lambda for FnNode k
+    OP_ENTER,           // k: make a frame for the scope of LetNode k
+    OP_LEAVE,           // go back to the enclosing frame
+    OP_SET_SLOT,        // slot: pop into a slot of the current frame
+    OP_DEF_LOCAL,       // slot: set a slot to the top value
+    OP_DEF_GLOBAL,      // k: define the global named k as the top value
+    OP_MAKE_MACRO,      // replace the top value with a macro of it
+    OP_GLOBAL_OPERATOR, // g k tail to: OP_GLOBAL g then OP_CHECK_MACRO
+    OP_CHECK_MACRO,     // k tail to: if the operator of CallNode k is a
+                        //     macro, run the expansion and resume at to
+    OP_CALL,            // n: call with the top n values as arguments
+    OP_TAIL_CALL,       // n: the same, in place of the current call
+    OP_MACRO,           // k tail: expand MacroNode k, if it isn't yet,
+                        //     and run the expansion
+    OP_TRY,             // k handler end: catch into the scope of TryNode k
+    OP_END_TRY,
+    OP_MACROEXPAND,     // k: push the expansion of form k
+    OP_RETURN,
+};
+
+// Indexed by OpCode.
+static const struct {
+    const char* name;
+    int operands;
+} s_opcodes[] = {
+    { "CONST",          1 },
+    { "LOCAL",          3 },
+    { "GLOBAL",         1 },
+    { "POP",            0 },
+    { "JUMP",           1 },
+    { "JUMP_IF_FALSE",  1 },
+    { "VECTOR",         1 },
+    { "HASH",           1 },
+    { "FN",             1 },
+    { "ENTER",          1 },
+    { "LEAVE",          0 },
+    { "SET_SLOT",       1 },
+    { "DEF_LOCAL",      1 },
+    { "DEF_GLOBAL",     1 },
+    { "MAKE_MACRO",     0 },
+    { "GLOBAL_OPERATOR", 4 },
+    { "CHECK_MACRO",    3 },
+    { "CALL",           1 },
+    { "TAIL_CALL",      1 },
+    { "MACRO",          2 },
+    { "TRY",            3 },
+    { "END_TRY",        0 },
+    { "MACROEXPAND",    1 },
+    { "RETURN",         0 },
+};
+
+// A node compiled as the body of a function, so it always ends by
+// returning. Running it as a node runs the VM.
+class Bytecode : public malNode {
+public:
+    virtual malValuePtr step(const malEnvPtr& env, malValuePtr& next,
+                             malEnvPtr& nextEnv) const;
+
+    virtual void compile(Compiler& compiler, bool isTail) const {
+        ASSERT(false, "Bytecode is never compiled\n");
+    }
+
+    const int* ops() const { return m_ops.data(); }
+    const malValuePtr& constant(int index) const {
+        return m_constants[index];
+    }
+
+    String disassemble(const String& indent) const;
+
+private:
+    friend class Compiler;
+
+    std::vector<int> m_ops;
+    malValueVec m_constants;
+};
+
+class Compiler {
+public:
+    Compiler(Bytecode* bytecode) : m_bytecode(bytecode) { }
+
+    void compile(const malValuePtr& node, bool isTail) {
+        STATIC_CAST(malNode, node)->compile(*this, isTail);
+    }
+
+    // Compiles a node which only pushes its value, returning it if the
+    // node is in tail position.
+    void value(int op, int operand, bool isTail) {
+        emit(op, operand);
+        if (isTail) {
+            emit(OP_RETURN);
+        }
+    }
+
+    void emit(int op) { m_bytecode->m_ops.push_back(op); }
+    void emit(int op, int a) { emit(op); emit(a); }
+    void emit(int op, int a, int b) { emit(op, a); emit(b); }
+    void emit(int op, int a, int b, int c) { emit(op, a, b); emit(c); }
+
+    int constant(const malValuePtr& value) {
+        m_bytecode->m_constants.push_back(value);
+        return m_bytecode->m_constants.size() - 1;
+    }
+    int constant(const malNode* node) {
+        return constant(malValuePtr(const_cast<malNode*>(node)));
+    }
+
+    // Jump targets are offsets from the start of the code. A forward
+    // jump's target is patched in once it's known.
+    int here() const { return m_bytecode->m_ops.size(); }
+    int label() { emit(-1); return here() - 1; }
+    void patch(int label) { m_bytecode->m_ops[label] = here(); }
+
+private:
+    Bytecode* m_bytecode;
+};
+
+static const malValuePtr& bytecode(const malValuePtr& node)
+{
+    return STATIC_CAST(malNode, node)->bytecode();
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
+const malValuePtr& malNode::bytecode() const
 {
-    const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
-    return sym && (sym->value() == text);
+    if (!m_bytecode) {
+        Bytecode* bytecode = new Bytecode;
+        m_bytecode = bytecode;
+        Compiler(bytecode).compile(malValuePtr(const_cast<malNode*>(this)),
+                                   true);
+    }
+    return m_bytecode;
 }
 
-static const malSequence* isPair(malValuePtr obj)
+void ConstNode::compile(Compiler& compiler, bool isTail) const
 {
-    const malSequence* list = DYNAMIC_CAST(malSequence, obj);
-    return list && !list->isEmpty() ? list : NULL;
+    compiler.value(OP_CONST, compiler.constant(m_value), isTail);
 }
 
-static malValuePtr quasiquote(malValuePtr obj)
+void LocalRefNode::compile(Compiler& compiler, bool isTail) const
 {
-    const malSequence* seq = isPair(obj);
-    if (!seq) {
-        return mal::list(mal::symbol("quote"), obj);
+    malValuePtr symbol(const_cast<malSymbol*>(m_symbol));
+    compiler.emit(OP_LOCAL, m_depth, m_slot, compiler.constant(symbol));
+    if (isTail) {
+        compiler.emit(OP_RETURN);
     }
+}
 
-    if (isSymbol(seq->item(0), "unquote")) {
-        // (qq (uq form)) -> form
-        checkArgsIs("unquote", 1, seq->count() - 1);
-        return seq->item(1);
+void GlobalRefNode::compile(Compiler& compiler, bool isTail) const
+{
+    compiler.value(OP_GLOBAL, compiler.constant(this), isTail);
+}
+
+int malNode::compileOperator(Compiler& compiler, int call,
+                             bool isTail) const
+{
+    compile(compiler, false);
+    compiler.emit(OP_CHECK_MACRO, call, isTail);
+    return compiler.label();
+}
+
+// Calls of globals are the usual kind, so they get an opcode of their own.
+int GlobalRefNode::compileOperator(Compiler& compiler, int call,
+                                   bool isTail) const
+{
+    compiler.emit(OP_GLOBAL_OPERATOR, compiler.constant(this), call, isTail);
+    return compiler.label();
+}
+
+void VectorNode::compile(Compiler& compiler, bool isTail) const
+{
+    for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+        compiler.compile(*it, false);
     }
+    compiler.value(OP_VECTOR, m_items.size(), isTail);
+}
 
-    const malSequence* innerSeq = isPair(seq->item(0));
-    if (innerSeq && isSymbol(innerSeq->item(0), "splice-unquote")) {
-        checkArgsIs("splice-unquote", 1, innerSeq->count() - 1);
-        // (qq (sq '(a b c))) -> a b c
-        return mal::list(
-            mal::symbol("concat"),
-            innerSeq->item(1),
-            quasiquote(seq->rest())
-        );
+void HashNode::compile(Compiler& compiler, bool isTail) const
+{
+    for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+        compiler.compile(*it, false);
+    }
+    compiler.value(OP_HASH, m_items.size(), isTail);
+}
+
+void IfNode::compile(Compiler& compiler, bool isTail) const
+{
+    compiler.compile(m_test, false);
+    compiler.emit(OP_JUMP_IF_FALSE);
+    int otherwise = compiler.label();
+    compiler.compile(m_then, isTail);
+    int end = -1;
+    if (!isTail) {
+        compiler.emit(OP_JUMP);
+        end = compiler.label();
+    }
+    compiler.patch(otherwise);
+    if (m_else) {
+        compiler.compile(m_else, isTail);
     }
     else {
-        // (qq (a b c)) -> (list (qq a) (qq b) (qq c))
-        // (qq xs     ) -> (cons (qq (car xs)) (qq (cdr xs)))
-        return mal::list(
-            mal::symbol("cons"),
-            quasiquote(seq->first()),
-            quasiquote(seq->rest())
-        );
+        compiler.value(OP_CONST, compiler.constant(mal::nilValue()), isTail);
+    }
+    if (!isTail) {
+        compiler.patch(end);
     }
 }
 
-static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
+void DoNode::compile(Compiler& compiler, bool isTail) const
 {
-    if (const malSequence* seq = isPair(obj)) {
-        if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->first())) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
-                malValuePtr value = sym->eval(symEnv);
-                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
-                    return lambda->isMacro() ? lambda : NULL;
+    for (auto it = m_items.begin(), end = m_items.end() - 1;
+         it != end; ++it) {
+        compiler.compile(*it, false);
+        compiler.emit(OP_POP);
+    }
+    compiler.compile(m_items.back(), isTail);
+}
+
+void LetNode::compile(Compiler& compiler, bool isTail) const
+{
+    compiler.emit(OP_ENTER, compiler.constant(this));
+    const std::vector<int>& slots = m_scope->bindings();
+    for (int i = 0, n = slots.size(); i < n; i++) {
+        compiler.compile(m_values[i], false);
+        compiler.emit(OP_SET_SLOT, slots[i]);
+    }
+    compiler.compile(m_body, isTail);
+    if (!isTail) {
+        compiler.emit(OP_LEAVE);
+    }
+}
+
+void FnNode::compile(Compiler& compiler, bool isTail) const
+{
+    compiler.value(OP_FN, compiler.constant(this), isTail);
+}
+
+void DefNode::compile(Compiler& compiler, bool isTail) const
+{
+    compiler.compile(m_value, false);
+    if (m_isMacro) {
+        compiler.emit(OP_MAKE_MACRO);
+    }
+    if (m_slot >= 0) {
+        compiler.value(OP_DEF_LOCAL, m_slot, isTail);
+    }
+    else {
+        malValuePtr symbol(const_cast<malSymbol*>(m_symbol));
+        compiler.value(OP_DEF_GLOBAL, compiler.constant(symbol), isTail);
+    }
+}
+
+void TryNode::compile(Compiler& compiler, bool isTail) const
+{
+    // The handler runs in a frame of its own, like a let*.
+    compiler.emit(OP_TRY, compiler.constant(this));
+    int handler = compiler.label();
+    int afterBody = compiler.label();
+    compiler.compile(m_body, false);
+    compiler.emit(OP_END_TRY);
+    compiler.patch(afterBody);
+    int end = -1;
+    if (isTail) {
+        compiler.emit(OP_RETURN);
+    }
+    else {
+        compiler.emit(OP_JUMP);
+        end = compiler.label();
+    }
+    compiler.patch(handler);
+    compiler.compile(m_handler, isTail);
+    if (!isTail) {
+        compiler.emit(OP_LEAVE);
+        compiler.patch(end);
+    }
+}
+
+void MacroExpandNode::compile(Compiler& compiler, bool isTail) const
+{
+    compiler.value(OP_MACROEXPAND, compiler.constant(m_form), isTail);
+}
+
+void CallNode::compile(Compiler& compiler, bool isTail) const
+{
+    int resume = STATIC_CAST(malNode, m_items[0])
+        ->compileOperator(compiler, compiler.constant(this), isTail);
+    for (auto it = m_items.begin() + 1, end = m_items.end(); it != end; ++it) {
+        compiler.compile(*it, false);
+    }
+    compiler.emit(isTail ? OP_TAIL_CALL : OP_CALL, m_items.size() - 1);
+    compiler.patch(resume);
+}
+
+void MacroNode::compile(Compiler& compiler, bool isTail) const
+{
+    compiler.emit(OP_MACRO, compiler.constant(this), isTail);
+}
+
+class VM {
+public:
+    VM() : m_stack(malArgs::stack()) { }
+
+    malValuePtr execute(const malValuePtr& bytecode, const malEnvPtr& env);
+
+private:
+    struct Frame {
+        Frame(const malValuePtr& bytecode, const malEnvPtr& env, int base)
+            : bytecode(bytecode)
+            , pc(STATIC_CAST(Bytecode, bytecode)->ops())
+            , env(env), base(base) { }
+
+        malValuePtr bytecode;
+        const int* pc;
+        malEnvPtr env;
+        int base; // the height of the stack when the frame was entered
+    };
+
+    struct Handler {
+        int frame;
+        int height;
+        malEnvPtr env;
+        const TryNode* node;
+        int handler;
+        int end;
+    };
+
+    malValuePtr loop();
+    bool unwind(const malValuePtr& exception);
+
+    malArgStack& m_stack; // shared with the calls of the tree walker
+    std::vector<Frame> m_frames;
+    std::vector<Handler> m_handlers;
+};
+
+malValuePtr Bytecode::step(const malEnvPtr& env, malValuePtr& next,
+                           malEnvPtr& nextEnv) const
+{
+    return VM().execute(malValuePtr(const_cast<Bytecode*>(this)), env);
+}
+
+malValuePtr VM::execute(const malValuePtr& bytecode, const malEnvPtr& env)
+{
+    malArgs args; // pops anything left on the stack by an exception
+    m_frames.push_back(Frame(bytecode, env, m_stack.size()));
+    while (true) {
+        try {
+            return loop();
+        }
+        catch(String& s) {
+            if (!unwind(mal::string(s))) {
+                throw;
+            }
+        }
+        catch (malEmptyInputException&) {
+            if (!unwind(malValuePtr())) {
+                throw;
+            }
+        }
+        catch(malValuePtr& o) {
+            if (!unwind(o)) {
+                throw;
+            }
+        };
+    }
+}
+
+// Goes back to the innermost try*, and runs its handler, or, for an empty
+// input exception, carries on as if the body had returned nil.
+bool VM::unwind(const malValuePtr& exception)
+{
+    if (m_handlers.empty()) {
+        return false;
+    }
+    Handler handler = std::move(m_handlers.back());
+    m_handlers.pop_back();
+    m_frames.erase(m_frames.begin() + handler.frame + 1, m_frames.end());
+    m_stack.resize(handler.height);
+
+    Frame& frame = m_frames.back();
+    const int* ops = STATIC_CAST(Bytecode, frame.bytecode)->ops();
+    if (!exception) {
+        m_stack.push_back(mal::nilValue());
+        frame.env = handler.env;
+        frame.pc = ops + handler.end;
+        return true;
+    }
+    const malScopePtr& scope = handler.node->scope();
+    frame.env = new malEnv(handler.env, scope);
+    frame.env->setSlot(scope->bindings()[0], exception);
+    frame.pc = ops + handler.handler;
+    return true;
+}
+
+malValuePtr VM::loop()
+{
+    Frame* frame = &m_frames.back();
+    const Bytecode* code = STATIC_CAST(Bytecode, frame->bytecode);
+    const int* pc = frame->pc;
+
+    // Calls save the pc in the caller's frame, and switch to the callee's.
+    #define SWITCH_FRAME() \
+        frame = &m_frames.back(); \
+        code = STATIC_CAST(Bytecode, frame->bytecode); \
+        pc = frame->pc;
+
+    while (true) {
+        int op = *pc++;
+        switch (op) {
+            case OP_CONST:
+                m_stack.push_back(code->constant(*pc++));
+                break;
+
+            case OP_LOCAL: {
+                const malSymbol* symbol =
+                    STATIC_CAST(malSymbol, code->constant(pc[2]));
+                m_stack.push_back(frame->env->get(pc[0], pc[1], symbol));
+                pc += 3;
+                break;
+            }
+
+            case OP_GLOBAL:
+                m_stack.push_back(
+                    STATIC_CAST(GlobalRefNode, code->constant(*pc++))->get());
+                break;
+
+            case OP_POP:
+                m_stack.pop_back();
+                break;
+
+            case OP_JUMP:
+                pc = code->ops() + *pc;
+                break;
+
+            case OP_JUMP_IF_FALSE: {
+                bool isTrue = isTruthy(m_stack.back());
+                m_stack.pop_back();
+                pc = isTrue ? pc + 1 : code->ops() + *pc;
+                break;
+            }
+
+            case OP_VECTOR: {
+                int count = *pc++;
+                malValueVec* items =
+                    new malValueVec(m_stack.end() - count, m_stack.end());
+                m_stack.resize(m_stack.size() - count);
+                m_stack.push_back(mal::vector(items));
+                break;
+            }
+
+            case OP_HASH: {
+                int count = *pc++;
+                malValuePtr hash = mal::hash(m_stack.end() - count,
+                                             m_stack.end(), true);
+                m_stack.resize(m_stack.size() - count);
+                m_stack.push_back(hash);
+                break;
+            }
+
+            case OP_FN:
+                m_stack.push_back(STATIC_CAST(FnNode, code->constant(*pc++))
+                                  ->makeLambda(frame->env));
+                break;
+
+            case OP_ENTER: {
+                const LetNode* let = STATIC_CAST(LetNode, code->constant(*pc++));
+                frame->env = new malEnv(frame->env, let->scope());
+                break;
+            }
+
+            case OP_LEAVE: {
+                malEnvPtr outer = frame->env->outer();
+                frame->env = std::move(outer);
+                break;
+            }
+
+            case OP_SET_SLOT:
+                frame->env->setSlot(*pc++, m_stack.back());
+                m_stack.pop_back();
+                break;
+
+            case OP_DEF_LOCAL:
+                frame->env->setSlot(*pc++, m_stack.back());
+                break;
+
+            case OP_DEF_GLOBAL:
+                frame->env->set(STATIC_CAST(malSymbol, code->constant(*pc++)),
+                                m_stack.back());
+                break;
+
+            case OP_MAKE_MACRO:
+                m_stack.back() =
+                    mal::macro(*VALUE_CAST(malLambda, m_stack.back()));
+                break;
+
+            case OP_GLOBAL_OPERATOR:
+                m_stack.push_back(
+                    STATIC_CAST(GlobalRefNode, code->constant(*pc++))->get());
+                // fall through
+
+            case OP_CHECK_MACRO:
+            case OP_MACRO: {
+                bool isTail = pc[1];
+                malValuePtr expansion;
+                if (op == OP_MACRO) {
+                    const MacroNode* node =
+                        STATIC_CAST(MacroNode, code->constant(pc[0]));
+                    expansion = bytecode(node->expansion(frame->env));
+                    pc += 2;
+                }
+                else {
+                    const malLambda* macro =
+                        DYNAMIC_CAST(malLambda, m_stack.back());
+                    if (!macro || !macro->isMacro()) {
+                        pc += 3;
+                        break;
+                    }
+                    const CallNode* node =
+                        STATIC_CAST(CallNode, code->constant(pc[0]));
+                    expansion =
+                        bytecode(expand(node->site(), macro, frame->env));
+                    m_stack.pop_back();
+                    pc = code->ops() + pc[2];
+                }
+
+                // The expansion runs in the current environment, rather
+                // than a new one as a function's body does.
+                if (isTail) {
+                    m_stack.resize(frame->base);
+                    frame->bytecode = std::move(expansion);
+                    frame->pc = STATIC_CAST(Bytecode, frame->bytecode)->ops();
                 }
+                else {
+                    malEnvPtr env = frame->env;
+                    frame->pc = pc;
+                    m_frames.push_back(Frame(expansion, env, m_stack.size()));
+                }
+                SWITCH_FRAME();
+                break;
+            }
+
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                int count = *pc++;
+                malValueIter args = m_stack.end() - count;
+                const malValuePtr& fn = *(args - 1);
+                const malLambda* lambda = DYNAMIC_CAST(malLambda, fn);
+                if (!lambda) {
+                    malValuePtr result = APPLY(fn, args, m_stack.end());
+                    m_stack.resize(m_stack.size() - count - 1);
+                    m_stack.push_back(std::move(result));
+                    if (op == OP_TAIL_CALL) {
+                        goto doReturn;
+                    }
+                    break;
+                }
+
+                malValuePtr body = bytecode(lambda->getBody());
+                malEnvPtr env = lambda->makeEnv(args, m_stack.end());
+                if (op == OP_TAIL_CALL) {
+                    m_stack.resize(frame->base);
+                    frame->bytecode = std::move(body);
+                    frame->pc = STATIC_CAST(Bytecode, frame->bytecode)->ops();
+                    frame->env = std::move(env);
+                }
+                else {
+                    m_stack.resize(m_stack.size() - count - 1);
+                    frame->pc = pc;
+                    m_frames.push_back(Frame(body, env, m_stack.size()));
+                }
+                SWITCH_FRAME();
+                break;
             }
+
+            case OP_TRY: {
+                Handler handler = {
+                    static_cast<int>(m_frames.size()) - 1,
+                    static_cast<int>(m_stack.size()),
+                    frame->env,
+                    STATIC_CAST(TryNode, code->constant(pc[0])),
+                    pc[1],
+                    pc[2],
+                };
+                m_handlers.push_back(std::move(handler));
+                pc += 3;
+                break;
+            }
+
+            case OP_END_TRY:
+                m_handlers.pop_back();
+                break;
+
+            case OP_MACROEXPAND:
+                m_stack.push_back(macroExpand(code->constant(*pc++),
+                                              frame->env));
+                break;
+
+            case OP_RETURN:
+            doReturn: {
+                malValuePtr result = std::move(m_stack.back());
+                m_stack.resize(frame->base);
+                m_frames.pop_back();
+                if (m_frames.empty()) {
+                    return result;
+                }
+                m_stack.push_back(std::move(result));
+                SWITCH_FRAME();
+                break;
+            }
+
+            default:
+                ASSERT(false, "Bad opcode %d\n", op);
         }
     }
-    return NULL;
+
+    #undef SWITCH_FRAME
 }
 
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
+String Bytecode::disassemble(const String& indent) const
 {
-    while (const malLambda* macro = isMacroApplication(obj, env)) {
-        const malSequence* seq = STATIC_CAST(malSequence, obj);
-        obj = macro->apply(seq->begin() + 1, seq->end());
+    String out;
+    for (const int* pc = ops(), *end = pc + m_ops.size(); pc < end; ) {
+        int op = *pc;
+        out += STRF("%s%4d  %-15s", indent.c_str(),
+                    static_cast<int>(pc - ops()), s_opcodes[op].name);
+        for (int i = 1; i <= s_opcodes[op].operands; i++) {
+            out += STRF(" %d", pc[i]);
+        }
+
+        // Say what the constant is, where that's helpful.
+        switch (op) {
+            case OP_CONST:
+            case OP_DEF_GLOBAL:
+            case OP_MACROEXPAND:
+                out += "  ; " + mal::print(constant(pc[1]), true);
+                break;
+
+            case OP_LOCAL:
+                out += "  ; " + constant(pc[3])->print(true);
+                break;
+
+            case OP_GLOBAL:
+            case OP_GLOBAL_OPERATOR:
+                out += "  ; " + STATIC_CAST(GlobalRefNode, constant(pc[1]))
+                                    ->symbol()->print(true);
+                break;
+        }
+        out += "\n";
+
+        if (op == OP_FN) {
+            const FnNode* fn = STATIC_CAST(FnNode, constant(pc[1]));
+            out += STATIC_CAST(Bytecode, ::bytecode(fn->body()))
+                       ->disassemble(indent + "    ");
+        }
+        pc += 1 + s_opcodes[op].operands;
+    }
+    return out;
+}
+
+// (disassemble f) lists the bytecode for a function's body, or for a form.
+static malValuePtr disassemble(const String& name,
+                               malValueIter argsBegin, malValueIter argsEnd)
+{
+    checkArgsIs(name.c_str(), 1, std::distance(argsBegin, argsEnd));
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, *argsBegin);
+    malValuePtr node = lambda ? lambda->getBody()
+                              : analyze(*argsBegin, replEnv);
+    const Bytecode* code = STATIC_CAST(Bytecode, bytecode(node));
+    return mal::string(code->disassemble(""));
+}
+
+static void installDisassembler(const malEnvPtr& env)
+{
+    env->set("disassemble", mal::builtin("disassemble", disassemble));
+}
+
+static void installSpecialForms()
+{
+    struct {
+        const char* name;
+        SpecialForm id;
+    } specialFormTable[] = {
+        { "catch*",         SF_CATCH },
+        { "def!",           SF_DEF },
+        { "defmacro!",      SF_DEFMACRO },
+        { "do",             SF_DO },
+        { "fn*",            SF_FN },
+        { "if",             SF_IF },
+        { "let*",           SF_LET },
+        { "macroexpand",    SF_MACROEXPAND },
+        { "quasiquote",     SF_QUASIQUOTE },
+        { "quote",          SF_QUOTE },
+        { "try*",           SF_TRY },
+    };
+
+    for (auto &form : specialFormTable) {
+        STATIC_CAST(malSymbol, mal::symbol(form.name))
+            ->setSpecialForm(form.id);
     }
-    return obj;
 }
 
 static const char* macroTable[] = {
@@ -326,7 +1730,7 @@ static const char* macroTable[] = {
     "(defmacro! or (fn* (& xs) (if (empty? xs) nil (if (= 1 (count xs)) (first xs) (let* (condvar (gensym)) `(let* (~condvar ~(first xs)) (if ~condvar ~condvar (or ~@(rest xs)))))))))",
 };
 
-static void installMacros(malEnvPtr env)
+static void installMacros(const malEnvPtr& env)
 {
     for (auto &macro : macroTable) {
         rep(macro, env);
@@ -348,8 +1752,6 @@ static const char* malFunctionTable[] = {
     "(def! >= (fn* (a b) (<= b a)))",
     "(def! < (fn* (a b) (not (<= b a))))",
     "(def! > (fn* (a b) (not (<= a b))))",
-    "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \")\")))))",
     "(def! map (fn* (f xs) (if (empty? xs) xs \
         (cons (f (first xs)) (map f (rest xs))))))",
     "(def! *gensym-counter* (atom 0))",
@@ -357,7 +1759,7 @@ static const char* malFunctionTable[] = {
     "(def! *host-language* \"C++\")",
 };
 
-static void installFunctions(malEnvPtr env) {
+static void installFunctions(const malEnvPtr& env) {
     for (auto &function : malFunctionTable) {
         rep(function, env);
     }